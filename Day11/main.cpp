@@ -1,5 +1,6 @@
 #include "aoc/helpers.h"
 #include "aoc/computer.h"
+#include "aoc/coroutine.h"
 #include <array>
 #include <map>
 #include <set>
@@ -61,38 +62,17 @@ namespace {
     const int val = static_cast<int>(dir);
     return static_cast<Direction>((val + 3) & 3);
   };
-};
-
-int main(int argc, char** argv) {
-  aoc::AutoTimer t;
-
-  auto f = aoc::open_argv_1(argc, argv);
 
-  std::string s;
-  aoc::getline(f, s);
-
-  aoc19::Computer c(s, true);
-
-  for (int i = 0; i < 2; i++) {
-    Grid g;
-    aoc19::InputOutputs outputs;
-    
+  /// The robot's position and heading, painting g as it is told
+  struct Robot {
+    Grid& g;
+    Point& top_left;
+    Point& bottom_right;
     // Initial point is 0,0
     Point pos{0, 0};
     Direction dir = Direction::Up;
 
-    c.initialize();
-    c.set_input(i);
-
-    Point top_left{ 0, 0 };
-    Point bottom_right{0, 0};
-
-    while (true) {
-      auto result = c.run(outputs);
-      if (result == aoc19::HaltCode::Halt) {
-        break;
-      }
-      const auto color = outputs.front(); outputs.pop();
+    void paint(int64_t color) {
       assert (color == 1 || color == 0);
 
       Color nc;
@@ -109,9 +89,10 @@ int main(int argc, char** argv) {
 
       auto ir = g.insert(std::pair(pos, Color::White));
       ir.first->second = nc;
+    }
 
-      result = c.run(outputs);
-      const auto turn = outputs.front(); outputs.pop();
+    /// Turn and move, returning the colour under the robot now
+    int64_t move(int64_t turn) {
       assert (turn == 1 || turn == 0);
 
       if (turn == 0) {
@@ -124,19 +105,86 @@ int main(int argc, char** argv) {
       pos.first += w->second.first;
       pos.second += w->second.second;
 
-      const auto paint = g.find(pos);
-      c.set_input((paint == g.end() || paint->second == Color::Black) ? 0 : 1);
-
       top_left.first = std::min(top_left.first, pos.first);
       top_left.second = std::min(top_left.second, pos.second);
 
       bottom_right.first = std::max(bottom_right.first, pos.first);
       bottom_right.second = std::max(bottom_right.second, pos.second);
 
+      const auto paint = g.find(pos);
+      return (paint == g.end() || paint->second == Color::Black) ? 0 : 1;
+    }
+  };
+
+#if defined(__cpp_impl_coroutine)
+  /// Paints as the robot says, telling it the colour under it after each
+  /// move, until it halts
+  aoc19::Driver Drive(aoc19::Vm& vm, Robot& robot) {
+    while (const auto color = co_await vm.read()) {
+      robot.paint(*color);
+
+      const auto turn = co_await vm.read();
+      if (!turn) {
+        break;
+      }
+      vm.write(robot.move(*turn));
+    }
+  }
+
+  /// Run the robot program in c, started on a panel of colour start
+  void Paint(aoc19::Computer& c, int64_t start, Robot& robot) {
+    aoc19::Vm vm(c);
+    vm.write(start);
+
+    const auto driver = Drive(vm, robot);
+    if (!driver.done()) {
+      throw std::runtime_error("Robot is waiting for input");
+    }
+  }
+#else
+  /// Run the robot program in c, started on a panel of colour start
+  void Paint(aoc19::Computer& c, int64_t start, Robot& robot) {
+    aoc19::InputOutputs outputs;
+    c.set_input(start);
+
+    while (true) {
+      auto result = c.run(outputs);
+      if (result == aoc19::HaltCode::Halt) {
+        break;
+      }
+      const auto color = outputs.front(); outputs.pop();
+      robot.paint(color);
+
+      result = c.run(outputs);
+      const auto turn = outputs.front(); outputs.pop();
+      c.set_input(robot.move(turn));
+
       if (result == aoc19::HaltCode::Halt) {
         break;
       }
     }
+  }
+#endif
+};
+
+int main(int argc, char** argv) {
+  aoc::AutoTimer t;
+
+  auto f = aoc::open_argv_1(argc, argv);
+
+  std::string s;
+  aoc::getline(f, s);
+
+  aoc19::Computer c(s, true);
+
+  for (int i = 0; i < 2; i++) {
+    Grid g;
+    Point top_left{ 0, 0 };
+    Point bottom_right{0, 0};
+
+    c.initialize();
+    Robot robot{ g, top_left, bottom_right };
+    Paint(c, i, robot);
 
     if (i == 0) {
       std::cout << "Part 1: " << g.size() << std::endl;
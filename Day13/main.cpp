@@ -37,105 +37,67 @@ int main(int argc, char** argv) {
   f.close();
 
   aoc19::Computer c(s, true);
+  c.set_trace(aoc19::TraceRecorder::from_environment(c.program()));
   
+  const auto unexpected = [&c](aoc19::HaltCode result) {
+    if (result == aoc19::HaltCode::Halt) {
+      return false;
+    }
+    std::cerr << "Unexpected error: " << std::endl;
+    std::cerr << c << std::endl;
+    return true;
+  };
+
+  // The screen is drawn as (x, y, tile) triples, the sinks take them as they
+  // are written instead of coming back here for each value
   c.initialize();
   size_t blocks_count = 0;
-  bool running = true;
-  aoc19::InputOutputs outputs;
-  do {
-    const auto result = c.run(outputs);
-
-    switch (result) {
-      case aoc19::HaltCode::HasOutput:
-        if (outputs.size() < 3) {
-          break;
-        }
-        while (!outputs.empty()) {
-          outputs.pop();
-          outputs.pop();
-          auto t = outputs.front(); outputs.pop();
-
-          blocks_count += static_cast<Type>(t) == Type::Block;
-        }
-        break;
-      case aoc19::HaltCode::Halt:
-        running = false;
-        break;
-      case aoc19::HaltCode::NeedsInput:
-      case aoc19::HaltCode::Error:
-        std::cerr << "Unexpected error: " << std::endl;
-        std::cerr << c << std::endl;
-        return -1;
-    }
-  } while (running);
+  auto count_blocks = aoc19::make_group_sink<3>([&blocks_count](const auto& v) {
+    blocks_count += static_cast<Type>(v[2]) == Type::Block;
+  });
+  if (unexpected(c.run_with(aoc19::NoSource{}, count_blocks))) {
+    return -1;
+  }
 
   std::cout << "Part 1: " << blocks_count << std::endl;
 
   // play game
-  while (!outputs.empty()) {
-    outputs.pop();
-  }
-
   c.initialize();
   c.set_memory(0, 2);
-  running = true;
   Board board;
   int64_t bat_x = 0;
   int64_t ball_x = 0;
   int64_t score = 0;
-  do {
-    const auto result = c.run(outputs);
-
-    switch (result) {
-      case aoc19::HaltCode::HasOutput:
-        if (outputs.size() < 3) {
-          break;
-        }
-        while (!outputs.empty()) {
-          auto x = outputs.front(); outputs.pop();
-          auto y = outputs.front(); outputs.pop();
-          auto t = outputs.front(); outputs.pop();
-
-          if (x < 0) {
-            score = t;
-          } else {
-            board.emplace_back(x, y, t);
+  auto draw = aoc19::make_group_sink<3>([&](const auto& v) {
+    const auto x = v[0];
+    const auto t = v[2];
+    if (x < 0) {
+      score = t;
+      return;
+    }
+    board.emplace_back(x, v[1], t);
 
-            switch (static_cast<Type>(t)) {
-              case Type::Ball:
-                ball_x = x;
-                break;
-              case Type::Bat:
-                bat_x = x;
-                break;
-              default:
-                break;
-            }
-          }
-        }
+    switch (static_cast<Type>(t)) {
+      case Type::Ball:
+        ball_x = x;
         break;
-      case aoc19::HaltCode::Halt:
-        running = false;
+      case Type::Bat:
+        bat_x = x;
         break;
-      case aoc19::HaltCode::NeedsInput:
-        if (bat_x < ball_x) {
-          c.set_input(1);
-        } else if (bat_x == ball_x) {
-          c.set_input(0);
-        } else {
-          c.set_input( -1 );
-        }
+      default:
         break;
-      case aoc19::HaltCode::Error:
-        std::cerr << "Unexpected error: " << std::endl;
-        std::cerr << c << std::endl;
-        return -1;
     }
-  } while (running);
-
-  while (!outputs.empty()) {
-    std::cout << "Output: " << outputs.front() << std::endl;
-    outputs.pop();
+  });
+  auto joystick = aoc19::make_source([&]() -> int64_t {
+    if (bat_x < ball_x) {
+      return 1;
+    } else if (bat_x == ball_x) {
+      return 0;
+    }
+    return -1;
+  });
+  if (unexpected(c.run_with(joystick, draw))) {
+    return -1;
   }
 
   std::cout << "Part 2: " << score << std::endl;
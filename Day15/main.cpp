@@ -5,6 +5,7 @@
 #include <map>
 #include <chrono>
 #include <thread>
+#include <climits>
 
 namespace {
 
@@ -47,6 +48,7 @@ namespace {
       case Direction::East:
         return Direction::West;
     }
+    return d;
   };
     
   enum class Tile {
@@ -301,6 +303,7 @@ int main(int argc, char** argv) {
 #endif
 
   aoc19::Computer c(s, true);
+  c.set_trace(aoc19::TraceRecorder::from_environment(c.program()));
   aoc19::InputOutputs outputs;
 
   Grid grid;
@@ -380,6 +383,7 @@ int main(int argc, char** argv) {
 #endif
         }
         break;
+      case aoc19::HaltCode::BudgetExhausted:
       case aoc19::HaltCode::Error:
         std::cerr << "Unexpected error: " << std::endl;
         std::cerr << c << std::endl;
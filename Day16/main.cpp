@@ -1,5 +1,6 @@
 #include "aoc/helpers.h"
 #include <vector>
+#include <cstring>
 
 namespace {
   using FFT = std::vector<char>;
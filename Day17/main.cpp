@@ -136,8 +136,8 @@ namespace {
     }
 
     bool is_intersection(size_t x, size_t y) const {
-      assert(x >= 0 && x < width_);
-      assert(y >= 0 && y < height_);
+      assert(x < width_);
+      assert(y < height_);
 
       if (x == 0 || x == width_ - 1) { return false; }
       else if (y == 0 || y == height_ -1) { return false; }
@@ -370,31 +370,19 @@ int main(int argc, char** argv) {
   const bool visualize = argc > 2 && argv[2][0] == '1';
   map.set_visualize(visualize);
 
-  aoc19::HaltCode hc;
-  do {
-    aoc19::InputOutputs outputs;
-    hc = c.run(outputs);
-    switch (hc) {
-      case aoc19::HaltCode::Halt:
-        break;
-      case aoc19::HaltCode::HasOutput:
-        map.push_pixel(static_cast<char>(outputs.front()));
-        outputs.pop();
-        break;
-      case aoc19::HaltCode::NeedsInput:
-        {
-          std::cout << "Input > ";
-          int64_t in;
-          std::cin >> in;
-          c.set_input(in);
-        }
-        break;
-      case aoc19::HaltCode::Error:
-        std::cerr << "Unexpected error: " << std::endl;
-        std::cerr << c << std::endl;
-        return -1;
-    }
-  } while (hc != aoc19::HaltCode::Halt);
+  auto camera = aoc19::make_sink([&map](int64_t value) { map.push_pixel(static_cast<char>(value)); });
+  auto keyboard = aoc19::make_source([]() {
+    std::cout << "Input > ";
+    int64_t in;
+    std::cin >> in;
+    return in;
+  });
+  auto hc = c.run_with(keyboard, camera);
+  if (hc != aoc19::HaltCode::Halt) {
+    std::cerr << "Unexpected error: " << std::endl;
+    std::cerr << c << std::endl;
+    return -1;
+  }
 
   DEBUG_PRINT(map);
 
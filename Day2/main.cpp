@@ -1,7 +1,38 @@
 #include "aoc/helpers.h"
+#include "aoc/cache.h"
 #include "aoc/computer.h"
+#include "aoc/sweep.h"
 #include <vector>
 
+namespace {
+
+    /// Address 0 after running with noun and verb, from the result cache if
+    /// there is one
+    int64_t run(aoc19::Computer& c, aoc19::ResultCache* cache, int64_t noun, int64_t verb) {
+        aoc19::HaltCode result;
+        int64_t value;
+        if (cache) {
+            const auto cached = cache->run(c, { { 1, noun }, { 2, verb } }, {}, { 0 });
+            result = cached.result;
+            value = cached.cells[0];
+        } else {
+            c.initialize(noun, verb);
+
+            aoc19::InputOutputs inputs;
+            aoc19::InputOutputs outputs;
+            result = c.run(inputs, outputs);
+            value = c.get(0);
+        }
+        if (result != aoc19::HaltCode::Halt) {
+            std::cerr << c << std::endl;
+            std::cerr << "Error encountered, last opcode " <<
+                c.get_last_op() << " at " << c.get_pc() << std::endl;
+        }
+        return value;
+    }
+
+};
+
 int main(int argc, char **argv) {
 
     aoc::AutoTimer t;
@@ -9,44 +40,25 @@ int main(int argc, char **argv) {
     auto f = aoc::open_argv_1(argc, argv);
     std::string s;
 
+    const auto cache = aoc19::ResultCache::from_environment();
+
     while (aoc::getline(f, s)) {
         aoc19::Computer c(s);
-        {
-            // Part 1
-            c.initialize(12, 2);
+        // Part 1
+        std::cout << "Part 1: " << run(c, cache.get(), 12, 2) << std::endl;
 
-            aoc19::InputOutputs inputs;
-            aoc19::InputOutputs outputs;
-            auto result = c.run(inputs, outputs);
-            if (result != aoc19::HaltCode::Halt) {
-                std::cerr << c << std::endl;
-                std::cerr << "Error encountered, last opcode " <<
-                    c.get_last_op() << " at " << c.get_pc() << std::endl;
-            }
-            std::cout << "Part 1: " << c.get(0) << std::endl;
-        }
-        // Part 2
-        bool done = false;
-        for (int64_t n = 0; !done && n < 100; n++) {
-            for (int64_t v = 0; !done && v < 100; v ++) {
-                c.initialize(n, v);
-                aoc19::InputOutputs inputs;
-                aoc19::InputOutputs outputs;
-                auto result = c.run(inputs, outputs);
-                if (result != aoc19::HaltCode::Halt) {
-                    std::cerr << c << std::endl;
-                    std::cerr << "Error encountered, last opcode " <<
-                        c.get_last_op() << " at " << c.get_pc() << std::endl;
-                }
-
-                DEBUG(std::cout << c.get(0) << std::endl);
-                
-                done = c.get(0) == 19690720;
-                if (done) {
-                    DEBUG(std::cout << "Noun: " << n << ", Verb: " << v << std::endl);
-                    std::cout << "Part 2: " << (n * 100 + v) << std::endl;
-                }
-            }
+        // Part 2, every noun and verb is n * 100 + v
+        const aoc19::Sweep sweep(c.program());
+        const auto found = sweep.find(100 * 100, [&](size_t k, aoc19::Computer& c) {
+            const auto value = run(c, cache.get(), k / 100, k % 100);
+
+            DEBUG(std::cout << value << std::endl);
+
+            return value == 19690720;
+        });
+        if (found) {
+            DEBUG(std::cout << "Noun: " << *found / 100 << ", Verb: " << *found % 100 << std::endl);
+            std::cout << "Part 2: " << *found << std::endl;
         }
     }
 
@@ -1,5 +1,6 @@
 #include "aoc/helpers.h"
 #include "aoc/computer.h"
+#include "aoc/sweep.h"
 #include <deque>
 
 namespace {
@@ -75,6 +76,15 @@ namespace {
     exit(-1);
   };
 
+  /// Every ordering of phases, in lexicographic order
+  const auto all_permutations = [](std::deque<int> phases) {
+    std::vector<std::deque<int>> permutations;
+    do {
+      permutations.push_back(phases);
+    } while (std::next_permutation(phases.begin(), phases.end()));
+    return permutations;
+  };
+
 };
 
 int main(int argc, char** argv) {
@@ -85,30 +95,39 @@ int main(int argc, char** argv) {
   std::string s;
   aoc::getline(f, s);
 
+  const aoc19::Sweep sweep(s);
+
   {
-    std::deque<int>phases = { 0, 1, 2, 3, 4};
-    int64_t max_out = INT64_MIN;
-    do {
-      aoc19::Computer amp{ s, true };
-      const int64_t out = run_amp_chain(amp, phases);
+    const auto permutations = all_permutations({ 0, 1, 2, 3, 4 });
+    const auto max_out = sweep.reduce(permutations.size(), INT64_MIN,
+      [&](size_t i, aoc19::Computer& amp) {
+        amp.set_run_to_completion(false);
+        const int64_t out = run_amp_chain(amp, permutations[i]);
 
-      DEBUG(std::cout << " Output: " << out << std::endl);
-      max_out = std::max(max_out, out);
-    } while (std::next_permutation(phases.begin(), phases.end()));
+        DEBUG(std::cout << " Output: " << out << std::endl);
+        return out;
+      },
+      [](int64_t a, int64_t b) { return std::max(a, b); });
 
     std::cout << "Part 1: " << max_out << std::endl;
   }
 
   {
-    std::deque<aoc19::Computer> amps { { s, true }, { s, true }, { s, true }, { s, true }, { s, true }, };
-    std::deque<int>phases = { 5, 6, 7, 8, 9};
-    int64_t max_out = INT64_MIN;
-    do {
-      const int64_t out = run_amp_feedback_chain(amps, phases);
+    const auto permutations = all_permutations({ 5, 6, 7, 8, 9 });
+    const auto max_out = sweep.reduce(permutations.size(), INT64_MIN,
+      [&](size_t i, aoc19::Computer& amp) {
+        // Five forks of this worker's Computer, sharing its image
+        amp.set_run_to_completion(false);
+        std::deque<aoc19::Computer> amps;
+        for (size_t a = 0; a < 5; a++) {
+          amps.push_back(amp.fork());
+        }
+        const int64_t out = run_amp_feedback_chain(amps, permutations[i]);
 
-      DEBUG(std::cout << " Output: " << out << std::endl);
-      max_out = std::max(max_out, out);
-    } while (std::next_permutation(phases.begin(), phases.end()));
+        DEBUG(std::cout << " Output: " << out << std::endl);
+        return out;
+      },
+      [](int64_t a, int64_t b) { return std::max(a, b); });
 
     std::cout << "Part 2: " << max_out << std::endl;
   }
@@ -1,7 +1,54 @@
 #include "aoc/helpers.h"
+#include "aoc/cache.h"
 #include "aoc/computer.h"
 #include <array>
 
+#if defined(AOC_AOT_Day9)
+#include "aoc/aot.h"
+AOC19_AOT_PROGRAM(Day9)
+#endif
+
+namespace {
+
+  const auto solve = [](auto& c) {
+    aoc19::InputOutputs outputs;
+
+    c.initialize();
+    c.set_input(1);
+
+    int64_t part1 = 0;
+    do {
+      const auto result = c.run(outputs);
+      if (!outputs.empty()) {
+        part1 = outputs.front();
+        outputs.pop();
+      }
+      if (result == aoc19::HaltCode::Halt) {
+        break;
+      }
+    } while (!part1);
+
+    std::cout << "Part 1: " << part1 << std::endl;
+
+    c.initialize();
+    c.set_input(2);
+    int64_t part2 = 0;
+    do {
+      const auto result = c.run(outputs);
+      if (!outputs.empty()) {
+        part2 = outputs.front();
+        outputs.pop();
+      }
+      if (result == aoc19::HaltCode::Halt) {
+        break;
+      }
+    } while (true);
+
+    std::cout << "Part 2: " << part2 << std::endl;
+  };
+
+};
+
 int main(int argc, char** argv) {
   aoc::AutoTimer t;
 
@@ -10,42 +57,29 @@ int main(int argc, char** argv) {
   aoc::getline(f, s);
   f.close();
 
+#if defined(AOC_AOT_Day9)
+  // The translated program is only any use if it is the one we were given
+  if (aoc19::AotComputer<aoc19::aot::Day9>::matches(s)) {
+    aoc19::AotComputer<aoc19::aot::Day9> c(true);
+    solve(c);
+    return 0;
+  }
+#endif
+
   aoc19::Computer c(s, true);
-  aoc19::InputOutputs outputs;
-  
-  c.initialize();
-  c.set_input(1);
-
-  int64_t part1 = 0;
-  do {
-    const auto result = c.run(outputs);
-    if (!outputs.empty()) {
-      part1 = outputs.front();
-      outputs.pop();
-    }
-    if (result == aoc19::HaltCode::Halt) {
-      break;
-    }
-  } while (!part1);
-
-  std::cout << "Part 1: " << part1 << std::endl;
-
-  c.initialize();
-  c.set_input(2);
-  int64_t part2 = 0;
-  do {
-    const auto result = c.run(outputs);
-    if (!outputs.empty()) {
-      part2 = outputs.front();
-      outputs.pop();
+  if (const auto cache = aoc19::ResultCache::from_environment()) {
+    // The first output of part 1 and the last of part 2 are the answers
+    const auto part1 = cache->run(c, { }, { 1 });
+    const auto part2 = cache->run(c, { }, { 2 });
+    if (part1.result == aoc19::HaltCode::Halt && part2.result == aoc19::HaltCode::Halt &&
+        !part1.outputs.empty() && !part2.outputs.empty()) {
+      std::cout << "Part 1: " << part1.outputs.front() << std::endl;
+      std::cout << "Part 2: " << part2.outputs.back() << std::endl;
+      return 0;
     }
-    if (result == aoc19::HaltCode::Halt) {
-      break;
-    }
-  } while (true);
-
-  std::cout << "Part 2: " << part2 << std::endl;
+    c.set_run_to_completion(false);
+  }
+  solve(c);
 
   return 0;
 }
-
@@ -0,0 +1,242 @@
+#pragma once
+
+#include "aoc/helpers.h"
+#include "aoc/program.h"
+#include <algorithm>
+#include <deque>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace intcode {
+
+using Instruction = aoc19::ImageInstruction;
+
+/// A run of instructions entered only at the top and left only at the bottom
+class Block {
+public:
+    size_t start = 0;
+    /// One past the last word of the last instruction
+    size_t end = 0;
+    std::vector<size_t> instructions;
+    /// Starts of the blocks control can go to next
+    std::vector<size_t> successors;
+    /// Ends in a jump whose target is read from memory
+    bool computed = false;
+    /// Ends in a halt or an instruction which can't be decoded
+    bool exits = false;
+};
+
+/*
+Static analysis of an IntCode program image, shared by the translator and
+the disassembler.
+
+Code is whatever is reachable from pc 0 by falling through or taking a jump
+with an immediate target. Calls store their return address as a constant
+(x + 0 or x * 1) and jump away, so the word after an unconditional jump is
+also code if some instruction found stores its address. Everything
+else is data. Code only reached through other computed jumps is missed, which
+the translator leaves to the interpreter.
+*/
+class Analysis {
+public:
+    explicit Analysis(std::vector<int64_t> image)
+        : _image(std::move(image)) {
+        discover();
+    }
+
+    static std::vector<int64_t> parse(const std::string& program) {
+        std::vector<int64_t> image;
+        aoc::parse_as_integers(program, ',', [&](const auto t) { image.push_back(t); });
+        return image;
+    }
+
+    const std::vector<int64_t>& image() const {
+        return _image;
+    }
+
+    /// Start of every instruction found
+    const std::set<size_t>& reachable() const {
+        return _reachable;
+    }
+
+    /// Which words belong to an instruction found
+    std::vector<uint8_t> get_code_map() const {
+        std::vector<uint8_t> code(_image.size(), 0);
+        for (const auto pc : _reachable) {
+            const auto insn = decode(pc);
+            for (size_t i = 0; i < insn.length; i++) {
+                code[pc + i] = 1;
+            }
+        }
+        return code;
+    }
+
+    /// Basic blocks in address order, split at every entry point and jump
+    /// target, and after every jump
+    std::vector<Block> get_blocks() const {
+        std::set<size_t> leaders = _entries;
+        for (const auto pc : _reachable) {
+            const auto insn = decode(pc);
+            if (is_jump(insn)) {
+                if (insn.modes[1] == 1 && insn.words[1] >= 0) {
+                    leaders.insert(insn.words[1]);
+                }
+                leaders.insert(pc + insn.length);
+            }
+        }
+
+        std::vector<Block> blocks;
+        size_t next = SIZE_MAX;
+        for (const auto pc : _reachable) {
+            const auto insn = decode(pc);
+            if (blocks.empty() || pc != next || leaders.count(pc)) {
+                close(blocks, next);
+                blocks.emplace_back();
+                blocks.back().start = pc;
+            }
+            auto& block = blocks.back();
+            block.instructions.push_back(pc);
+            block.end = pc + std::max<size_t>(insn.length, 1);
+            next = block.end;
+
+            if (!insn.length || insn.opcode == 99) {
+                block.exits = true;
+                next = SIZE_MAX;
+            } else if (is_jump(insn)) {
+                if (insn.modes[1] == 1) {
+                    if (insn.words[1] >= 0 && _reachable.count(insn.words[1])) {
+                        block.successors.push_back(insn.words[1]);
+                    }
+                } else {
+                    block.computed = true;
+                }
+                if (ends_block(insn)) {
+                    next = SIZE_MAX;
+                }
+                close(blocks, next);
+                next = SIZE_MAX;
+            }
+        }
+        close(blocks, next);
+        return blocks;
+    }
+
+protected:
+    std::vector<int64_t> _image;
+    std::set<size_t> _reachable;
+    /// pc 0 and the return addresses
+    std::set<size_t> _entries;
+
+    int64_t word(size_t address) const {
+        return address < _image.size() ? _image[address] : 0;
+    }
+
+    static bool is_output_parameter(int64_t opcode, size_t index) {
+        return ((opcode == 1 || opcode == 2 || opcode == 7 || opcode == 8) && index == 2) ||
+            (opcode == 3 && index == 0);
+    }
+
+    static bool is_jump(const Instruction& insn) {
+        return insn.length && (insn.opcode == 5 || insn.opcode == 6);
+    }
+
+    /// Whether insn stores a constant, x + 0 or x * 1, as calls store their
+    /// return address
+    static bool get_moved_immediate(const Instruction& insn, int64_t& value) {
+        if (!insn.length || (insn.opcode != 1 && insn.opcode != 2) || insn.modes[0] != 1 || insn.modes[1] != 1) {
+            return false;
+        }
+        const int64_t identity = insn.opcode == 1 ? 0 : 1;
+        if (insn.words[1] == identity) {
+            value = insn.words[0];
+            return true;
+        }
+        if (insn.words[0] == identity) {
+            value = insn.words[1];
+            return true;
+        }
+        return false;
+    }
+
+    /// Decode the instruction at pc, length is 0 if it is invalid or runs
+    /// off the end of the image
+    Instruction decode(size_t pc) const {
+        auto insn = aoc19::decode_instruction(_image.data(), _image.size(), pc);
+        for (size_t i = 0; i + 1 < insn.length; i++) {
+            if (insn.modes[i] == 1 && is_output_parameter(insn.opcode, i)) {
+                insn.length = 0;
+            }
+        }
+        return insn;
+    }
+
+    /// Whether control never falls through to the next instruction
+    static bool ends_block(const Instruction& insn) {
+        if (!insn.length || insn.opcode == 99) {
+            return true;
+        }
+        // Unconditional jumps
+        if (insn.modes[0] == 1) {
+            return (insn.opcode == 5 && insn.words[0] != 0) || (insn.opcode == 6 && insn.words[0] == 0);
+        }
+        return false;
+    }
+
+private:
+    void discover() {
+        std::deque<size_t> work;
+        const auto visit = [&](size_t pc) {
+            if (pc < _image.size() && !_reachable.count(pc)) {
+                _reachable.insert(pc);
+                work.push_back(pc);
+            }
+        };
+
+        // Return addresses: the pc after an unconditional jump, once some
+        // instruction stores it, whichever is found first
+        std::set<int64_t> immediates;
+        std::set<int64_t> after_jumps;
+        const auto entry = [&](int64_t pc) {
+            if (_entries.insert(pc).second) {
+                visit(pc);
+            }
+        };
+
+        entry(0);
+        while (!work.empty()) {
+            const auto pc = work.front(); work.pop_front();
+            const auto insn = decode(pc);
+            if (!insn.length) {
+                continue;
+            }
+            int64_t moved;
+            if (get_moved_immediate(insn, moved) && immediates.insert(moved).second && after_jumps.count(moved)) {
+                entry(moved);
+            }
+            if (is_jump(insn) && insn.modes[1] == 1 && insn.words[1] >= 0) {
+                visit(insn.words[1]);
+            }
+            const auto next = static_cast<int64_t>(pc + insn.length);
+            if (!ends_block(insn)) {
+                visit(next);
+            } else if (is_jump(insn) && after_jumps.insert(next).second && immediates.count(next)) {
+                entry(next);
+            }
+        }
+    }
+
+    /// Finish the last block, falling through to next if control gets there
+    void close(std::vector<Block>& blocks, size_t next) const {
+        if (blocks.empty() || blocks.back().exits) {
+            return;
+        }
+        auto& block = blocks.back();
+        if (next != SIZE_MAX && _reachable.count(next) &&
+                std::find(block.successors.begin(), block.successors.end(), next) == block.successors.end()) {
+            block.successors.push_back(next);
+        }
+    }
+};
+
+};
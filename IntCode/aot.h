@@ -0,0 +1,192 @@
+#pragma once
+
+#include "analysis.h"
+#include <ostream>
+
+namespace intcode {
+
+/*
+Ahead-of-time translation of an IntCode program to C++, for aoc/aot.h.
+
+Every instruction the Analysis finds becomes straight-line code under its
+own label. Jumps with an immediate target become gotos. Computed jumps go
+through a switch over every translated pc, and anything not translated
+(data, invalid opcodes, overwritten code) is left to the interpreter.
+*/
+class Translator : public Analysis {
+public:
+    Translator(const std::string& program)
+        : Analysis(parse(program))
+        , _source(program) {
+    }
+
+    size_t size() const {
+        return _reachable.size();
+    }
+
+    /// Write the translation unit for AotComputer<aot::name>
+    void emit(std::ostream& os, const std::string& name) const {
+        os << "// Generated by IntCode --aot, do not edit\n";
+        os << "#include \"aoc/aot.h\"\n\n";
+        os << "AOC19_AOT_PROGRAM(" << name << ")\n\n";
+        os << "namespace aoc19 {\n\n";
+        os << "namespace {\n";
+        os << "    const char Source[] = \"" << _source << "\";\n";
+        os << "    const uint8_t Code[] = {";
+        const auto code = get_code_map();
+        for (size_t i = 0; i < code.size(); i++) {
+            os << (i % 32 ? " " : "\n        ") << static_cast<int>(code[i]) << ",";
+        }
+        os << "\n    };\n";
+        os << "};\n\n";
+
+        os << "template <>\n";
+        os << "const AotImage AotComputer<aot::" << name << ">::Image = { Source, Code, sizeof(Code) };\n\n";
+
+        os << "template <>\n";
+        os << "HaltCode AotComputer<aot::" << name << ">::run(InputOutputs& outputs) {\n";
+        os << "    if (!initialized()) {\n";
+        os << "        initialize();\n";
+        os << "    }\n";
+        os << "    if (_translated_written) {\n";
+        os << "        return interpret(outputs);\n";
+        os << "    }\n";
+        os << "    goto dispatch;\n\n";
+
+        for (auto it = _reachable.begin(); it != _reachable.end(); ++it) {
+            const auto pc = *it;
+            const auto insn = decode(pc);
+            const auto next = pc + insn.length;
+
+            os << "L" << pc << ":\n";
+            if (!insn.length) {
+                os << "    _pc = " << pc << ";\n";
+                os << "    return interpret(outputs);\n";
+                continue;
+            }
+
+            emit_instruction(os, pc, insn);
+
+            // Fall through, unless the next translated pc is the next instruction
+            if (!ends_block(insn)) {
+                const auto following = std::next(it);
+                if (following == _reachable.end() || *following != next) {
+                    emit_goto(os, next, "    ");
+                }
+            }
+        }
+
+        os << "\ndispatch:\n";
+        os << "    switch (_pc) {\n";
+        for (const auto pc : _reachable) {
+            os << "        case " << pc << ": goto L" << pc << ";\n";
+        }
+        os << "    }\n";
+        os << "    return interpret(outputs);\n";
+        os << "}\n\n";
+        os << "};\n";
+    }
+
+private:
+    std::string _source;
+
+    static std::string literal(int64_t v) {
+        if (v == INT64_MIN) {
+            return "INT64_MIN";
+        }
+        return std::to_string(v) + "LL";
+    }
+
+    static std::string parameter(const Instruction& insn, size_t i) {
+        switch (insn.modes[i]) {
+            case 0:
+                return "get(" + literal(insn.words[i]) + ")";
+            case 1:
+                return literal(insn.words[i]);
+            default:
+                return "get(_relative_base + " + literal(insn.words[i]) + ")";
+        }
+    }
+
+    static std::string output_address(const Instruction& insn, size_t i) {
+        if (insn.modes[i] == 0) {
+            return literal(insn.words[i]);
+        }
+        return "_relative_base + " + literal(insn.words[i]);
+    }
+
+    /// Jump to pc, through its label if it was translated
+    void emit_goto(std::ostream& os, int64_t pc, const std::string& indent) const {
+        if (pc >= 0 && _reachable.count(pc)) {
+            os << indent << "goto L" << pc << ";\n";
+        } else {
+            os << indent << "_pc = " << literal(pc) << ";\n";
+            os << indent << "return interpret(outputs);\n";
+        }
+    }
+
+    void emit_store(std::ostream& os, const std::string& address, const std::string& value, size_t next) const {
+        os << "    if (write(" << address << ", " << value << ")) {\n";
+        os << "        _pc = " << next << ";\n";
+        os << "        return interpret(outputs);\n";
+        os << "    }\n";
+    }
+
+    void emit_instruction(std::ostream& os, size_t pc, const Instruction& insn) const {
+        const auto next = pc + insn.length;
+        switch (insn.opcode) {
+            case 1:
+                emit_store(os, output_address(insn, 2), parameter(insn, 0) + " + " + parameter(insn, 1), next);
+                break;
+            case 2:
+                emit_store(os, output_address(insn, 2), parameter(insn, 0) + " * " + parameter(insn, 1), next);
+                break;
+            case 3:
+                os << "    if (_inputs.empty()) {\n";
+                os << "        _pc = " << pc << ";\n";
+                os << "        return HaltCode::NeedsInput;\n";
+                os << "    }\n";
+                os << "    {\n";
+                os << "        const auto value = _inputs.front(); _inputs.pop();\n";
+                os << "        if (write(" << output_address(insn, 0) << ", value)) {\n";
+                os << "            _pc = " << next << ";\n";
+                os << "            return interpret(outputs);\n";
+                os << "        }\n";
+                os << "    }\n";
+                break;
+            case 4:
+                os << "    outputs.push(" << parameter(insn, 0) << ");\n";
+                os << "    if (_pause_on_output) {\n";
+                os << "        _pc = " << next << ";\n";
+                os << "        return HaltCode::HasOutput;\n";
+                os << "    }\n";
+                break;
+            case 5:
+            case 6:
+                os << "    if (" << (insn.opcode == 6 ? "!" : "") << parameter(insn, 0) << ") {\n";
+                if (insn.modes[1] == 1) {
+                    emit_goto(os, insn.words[1], "        ");
+                } else {
+                    os << "        _pc = " << parameter(insn, 1) << ";\n";
+                    os << "        goto dispatch;\n";
+                }
+                os << "    }\n";
+                break;
+            case 7:
+                emit_store(os, output_address(insn, 2), parameter(insn, 0) + " < " + parameter(insn, 1), next);
+                break;
+            case 8:
+                emit_store(os, output_address(insn, 2), parameter(insn, 0) + " == " + parameter(insn, 1), next);
+                break;
+            case 9:
+                os << "    _relative_base += " << parameter(insn, 0) << ";\n";
+                break;
+            case 99:
+                os << "    _pc = " << pc << ";\n";
+                os << "    return HaltCode::Halt;\n";
+                break;
+        }
+    }
+};
+
+};
@@ -0,0 +1,161 @@
+#pragma once
+
+#include "analysis.h"
+#include "aoc/profile.h"
+#include <iomanip>
+#include <ostream>
+#include <sstream>
+
+namespace intcode {
+
+/*
+Disassembly of an IntCode program, for IntCode --disasm.
+
+The listing has every basic block under an L<pc> label, with the blocks it
+goes to next, and every word which isn't part of an instruction as .data.
+Position operands are written [address], relative ones [rb+offset] and
+immediate ones as the bare value, or as a label if a jump goes there. The
+control-flow graph can also be written as a Graphviz DOT graph, one node per
+block.
+*/
+class Disassembler : public Analysis {
+public:
+    explicit Disassembler(std::vector<int64_t> image)
+        : Analysis(std::move(image))
+        , _blocks(get_blocks()) {
+    }
+
+    const std::vector<Block>& blocks() const {
+        return _blocks;
+    }
+
+    /// One line per instruction, `pc  words  MNEMONIC operands`
+    std::string format(size_t pc) const {
+        const auto insn = decode(pc);
+        std::stringstream words;
+        for (size_t i = 0; i < std::max<size_t>(insn.length, 1); i++) {
+            words << (i ? "," : "") << word(pc + i);
+        }
+
+        std::stringstream ss;
+        ss << std::setw(8) << pc << "  " << std::left << std::setw(30) << words.str() << std::right;
+        if (!insn.length) {
+            ss << "??? (" << word(pc) << ")";
+            return ss.str();
+        }
+        ss << aoc19::Profile::mnemonic(insn.opcode);
+        for (size_t i = 0; i + 1 < insn.length; i++) {
+            ss << (i ? ", " : " ") << operand(insn, i);
+        }
+        return ss.str();
+    }
+
+    void write_listing(std::ostream& os) const {
+        const auto code = get_code_map();
+        const auto data = std::count(code.begin(), code.end(), 0);
+        os << "; " << _image.size() << " words: " << _reachable.size() << " instructions in "
+            << _blocks.size() << " blocks, " << data << " words of data\n";
+
+        size_t address = 0;
+        for (const auto& block : _blocks) {
+            write_data(os, code, address, block.start);
+            os << "\n" << label(block.start) << ":";
+            if (!block.successors.empty() || block.computed) {
+                os << "  ; ->";
+                for (const auto s : block.successors) {
+                    os << " " << label(s);
+                }
+                if (block.computed) {
+                    os << " (computed)";
+                }
+            }
+            os << "\n";
+            for (const auto pc : block.instructions) {
+                os << format(pc) << "\n";
+            }
+            address = std::max(address, block.end);
+        }
+        write_data(os, code, address, _image.size());
+    }
+
+    /// Graphviz DOT, fall-through edges dashed and computed jumps going to
+    /// a single "computed" node
+    void write_dot(std::ostream& os) const {
+        os << "digraph intcode {\n";
+        os << "    node [shape=box, fontname=\"monospace\"];\n";
+        bool computed = false;
+        for (const auto& block : _blocks) {
+            os << "    " << label(block.start) << " [label=\"" << label(block.start) << ":\\l";
+            for (const auto pc : block.instructions) {
+                os << format(pc) << "\\l";
+            }
+            os << "\"];\n";
+            for (const auto s : block.successors) {
+                os << "    " << label(block.start) << " -> " << label(s) << (s == block.end ? " [style=dashed]" : "") << ";\n";
+            }
+            if (block.computed) {
+                os << "    " << label(block.start) << " -> computed [style=dotted];\n";
+                computed = true;
+            }
+        }
+        if (computed) {
+            os << "    computed [shape=ellipse];\n";
+        }
+        os << "}\n";
+    }
+
+private:
+    std::vector<Block> _blocks;
+
+    static std::string label(size_t pc) {
+        return "L" + std::to_string(pc);
+    }
+
+    std::string operand(const Instruction& insn, size_t i) const {
+        const auto w = insn.words[i];
+        switch (insn.modes[i]) {
+            case 0:
+                return "[" + std::to_string(w) + "]";
+            case 1:
+                if (i == 1 && is_jump(insn) && w >= 0 && _reachable.count(w)) {
+                    return label(w);
+                }
+                return std::to_string(w);
+            default:
+                return "[rb" + std::string(w < 0 ? "" : "+") + std::to_string(w) + "]";
+        }
+    }
+
+    /// Words in [first, last) which aren't code, eight to a line
+    void write_data(std::ostream& os, const std::vector<uint8_t>& code, size_t first, size_t last) const {
+        bool in_run = false;
+        size_t on_line = 0;
+        for (size_t a = first; a < last && a < _image.size(); a++) {
+            if (code[a]) {
+                if (on_line) {
+                    os << "\n";
+                }
+                in_run = false;
+                on_line = 0;
+                continue;
+            }
+            if (!in_run) {
+                os << "\n";
+                in_run = true;
+            }
+            if (!on_line) {
+                os << std::setw(8) << a << "  .data ";
+            }
+            os << (on_line ? ", " : "") << _image[a];
+            if (++on_line == 8) {
+                os << "\n";
+                on_line = 0;
+            }
+        }
+        if (on_line) {
+            os << "\n";
+        }
+    }
+};
+
+};
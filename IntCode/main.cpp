@@ -1,22 +1,187 @@
 #include "aoc/helpers.h"
 #include "aoc/computer.h"
+#include "aoc/replay.h"
+#include "aot.h"
+#include "disassembler.h"
 #include <array>
+#include <cstring>
+
+namespace {
+
+  /// IntCode --aot <program> <output.cpp> <Name>
+  int translate(int argc, char** argv) {
+    if (argc < 5) {
+      std::cerr << "Usage: " << argv[0] << " --aot <program> <output.cpp> <Name>" << std::endl;
+      return -1;
+    }
+
+    std::ifstream f(argv[2]);
+    std::string s;
+    if (!aoc::getline(f, s)) {
+      std::cerr << "Unable to read " << argv[2] << std::endl;
+      return -1;
+    }
+
+    const intcode::Translator t(s);
+    std::ofstream out(argv[3]);
+    t.emit(out, argv[4]);
+    if (!out.good()) {
+      std::cerr << "Unable to write " << argv[3] << std::endl;
+      return -1;
+    }
+
+    std::cout << "Translated " << t.size() << " instructions to " << argv[3] << std::endl;
+    return 0;
+  }
+
+  /// IntCode --binary <program> <output>
+  int convert(int argc, char** argv) {
+    if (argc < 4) {
+      std::cerr << "Usage: " << argv[0] << " --binary <program> <output>" << std::endl;
+      return -1;
+    }
+
+    std::ifstream f(argv[2]);
+    std::string s;
+    if (!aoc::getline(f, s)) {
+      std::cerr << "Unable to read " << argv[2] << std::endl;
+      return -1;
+    }
+
+    const auto program = aoc19::Program::parse(s);
+    program.save(argv[3]);
+
+    std::cout << "Wrote " << program.size() << " words to " << argv[3] << std::endl;
+    return 0;
+  }
+
+  /// The program named on the command line, as text or a binary from --binary
+  aoc19::Program read_program(int argc, char** argv) {
+    if (argc > 1 && aoc19::Program::is_binary(argv[1])) {
+      return aoc19::Program::map(argv[1]);
+    }
+
+    auto f = aoc::open_argv_1(argc, argv);
+    std::string s;
+    aoc::getline(f, s);
+    f.close();
+
+    return aoc19::Program::parse(s);
+  }
+
+  /// IntCode --disasm <program> [<output.dot>]
+  int disassemble(int argc, char** argv) {
+    if (argc < 3) {
+      std::cerr << "Usage: " << argv[0] << " --disasm <program> [<output.dot>]" << std::endl;
+      return -1;
+    }
+
+    const auto program = read_program(argc - 1, argv + 1);
+    const intcode::Disassembler d(std::vector<int64_t>(program.begin(), program.end()));
+    d.write_listing(std::cout);
+
+    if (argc > 3) {
+      std::ofstream out(argv[3]);
+      d.write_dot(out);
+      if (!out.good()) {
+        std::cerr << "Unable to write " << argv[3] << std::endl;
+        return -1;
+      }
+    }
+    return 0;
+  }
+
+  /// IntCode --replay <trace> <program>
+  int replay(int argc, char** argv) {
+    if (argc < 4) {
+      std::cerr << "Usage: " << argv[0] << " --replay <trace> <program>" << std::endl;
+      return -1;
+    }
+
+    const auto trace = aoc19::Trace::load(argv[2]);
+    aoc19::Computer c(read_program(argc - 2, argv + 2));
+    const auto result = aoc19::replay(trace, c);
+
+    std::cout << "Replayed " << result.records << " of " << trace.records().size() << " records ("
+      << result.inputs << " inputs, " << result.outputs << " outputs, " << result.branches << " branches)" << std::endl;
+    if (result.diverged) {
+      std::cout << "Diverged at record " << result.records << ": " << result.message << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+
+  /// Write the counts gathered by c to <prefix>.json, the flat profile to
+  /// <prefix>.folded and the call stacks to <prefix>.calls.folded
+  bool write_profile(const aoc19::Computer& c, const std::string& prefix) {
+#if defined(AOC_PROFILE)
+    std::ofstream json(prefix + ".json");
+    c.profile().write_json(json);
+    std::ofstream folded(prefix + ".folded");
+    c.profile().write_folded(folded);
+    std::ofstream calls(prefix + ".calls.folded");
+    c.profile().calls().write_folded(calls, "intcode");
+    if (!json.good() || !folded.good() || !calls.good()) {
+      std::cerr << "Unable to write the profile to " << prefix << ".*" << std::endl;
+      return false;
+    }
+    std::cerr << "Profiled " << c.profile().total() << " instructions to " << prefix << ".*" << std::endl;
+    return true;
+#else
+    (void)c;
+    std::cerr << "Not built with AOC_PROFILE, no profile written to " << prefix << std::endl;
+    return false;
+#endif
+  }
+
+};
 
 int main(int argc, char** argv) {
 
-  auto f = aoc::open_argv_1(argc, argv);
-  std::string s;
-  aoc::getline(f, s);
-  f.close();
+  if (argc > 1 && ::strcmp(argv[1], "--aot") == 0) {
+    return translate(argc, argv);
+  }
+  if (argc > 1 && ::strcmp(argv[1], "--binary") == 0) {
+    return convert(argc, argv);
+  }
+  if (argc > 1 && ::strcmp(argv[1], "--disasm") == 0) {
+    return disassemble(argc, argv);
+  }
+  if (argc > 1 && ::strcmp(argv[1], "--replay") == 0) {
+    return replay(argc, argv);
+  }
 
-  aoc19::Computer c(s, true);
+  // IntCode [--profile <prefix>] [--checkpoint <file>] <program>
+  std::string profile;
+  std::string checkpoint;
+  while (argc > 2 && (::strcmp(argv[1], "--profile") == 0 || ::strcmp(argv[1], "--checkpoint") == 0)) {
+    (::strcmp(argv[1], "--profile") == 0 ? profile : checkpoint) = argv[2];
+    argc -= 2;
+    argv += 2;
+  }
+
+  aoc19::Computer c(read_program(argc, argv), true);
+  c.set_trace(aoc19::TraceRecorder::from_environment(c.program()));
   aoc19::InputOutputs outputs;
   
   c.initialize();
+  // Carry on from the last time the program asked for input
+  if (!checkpoint.empty() && std::ifstream(checkpoint).good()) {
+    c.load(checkpoint, outputs);
+    std::cerr << "Resumed from " << checkpoint << std::endl;
+  }
   do {
     const auto result = c.run(outputs);
     switch (result) {
       case aoc19::HaltCode::Halt:
+        if (!profile.empty() && !write_profile(c, profile)) {
+          return -1;
+        }
+        if (c.memo().enabled()) {
+          const auto& stats = c.memo().stats();
+          std::cerr << "Memo: " << c.memo().functions().size() << " pure functions, " << stats.hits << " calls replayed, "
+            << stats.misses << " run (" << stats.recorded << " recorded), " << stats.flushes << " flushes" << std::endl;
+        }
         return 0;
       case aoc19::HaltCode::HasOutput:
         std::cout << "Output: " << outputs.front() << std::endl;
@@ -24,12 +189,19 @@ int main(int argc, char** argv) {
         break;
       case aoc19::HaltCode::NeedsInput:
         {
+          if (!checkpoint.empty()) {
+            c.save(checkpoint, outputs);
+          }
           std::cout << "Input > ";
           int64_t in;
-          std::cin >> in;
+          if (!(std::cin >> in) && !checkpoint.empty()) {
+            std::cerr << "Saved to " << checkpoint << std::endl;
+            return 0;
+          }
           c.set_input(in);
         }
         break;
+      case aoc19::HaltCode::BudgetExhausted:
       case aoc19::HaltCode::Error:
         std::cerr << "Unexpected error: " << std::endl;
         std::cerr << c << std::endl;
@@ -39,4 +211,3 @@ int main(int argc, char** argv) {
 
   return 0;
 }
-
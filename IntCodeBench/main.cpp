@@ -0,0 +1,460 @@
+#include "aoc/helpers.h"
+#include "aoc/computer.h"
+#include "aoc/batch.h"
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace {
+
+  using Clock = std::chrono::high_resolution_clock;
+  using Engine = aoc19::HaltCode (aoc19::Computer::*)(aoc19::InputOutputs&);
+
+  // Keep running each workload until it has had at least this much time
+  constexpr double MinSeconds = 0.25;
+  constexpr size_t MinRuns = 3;
+
+  using Respond = std::function<void(aoc19::Computer&, aoc19::InputOutputs&)>;
+
+  class Workload {
+  public:
+    const char* name;
+    const char* file;
+    std::vector<std::pair<size_t, int64_t>> patches;
+    std::vector<int64_t> inputs;
+    /// Called with the outputs so far whenever the program waits for input,
+    /// to give it some
+    Respond respond = nullptr;
+    /// The program, when there is no file
+    std::string text = "";
+  };
+
+  /// Day13's joystick, keeping the bat under the ball
+  class Joystick {
+  public:
+    int64_t ball = 0;
+    int64_t bat = 0;
+
+    void operator()(aoc19::Computer& c, aoc19::InputOutputs& outputs) {
+      while (outputs.size() >= 3) {
+        const auto x = outputs.front(); outputs.pop();
+        outputs.pop();
+        const auto tile = outputs.front(); outputs.pop();
+        if (x >= 0 && tile == 3) {
+          bat = x;
+        } else if (x >= 0 && tile == 4) {
+          ball = x;
+        }
+      }
+      c.set_input((ball > bat) - (ball < bat));
+    }
+  };
+
+  const auto ascii = [](const std::string& s) {
+    return std::vector<int64_t>(s.begin(), s.end());
+  };
+
+  const std::vector<Workload> Workloads = {
+    { "Day2 gravity assist", "Day2.txt", { { 1, 12 }, { 2, 2 } }, { } },
+    { "Day5 diagnostic", "Day5.txt", { }, { 5 } },
+    { "Day9 BOOST", "Day9.txt", { }, { 2 } },
+    { "Day13 arcade", "Day13.txt", { }, { } },
+    { "Day13 game", "Day13.txt", { { 0, 2 } }, { }, Joystick{} },
+    { "Day17 camera", "Day17.txt", { }, { } },
+    // The route for inputs/Day17.txt, as Day17 finds it
+    { "Day17 routing", "Day17.txt", { { 0, 2 } },
+      ascii("A,B,B,A,C,A,C,A,C,B\nL,6,R,12,R,8\nR,8,R,12,L,12\nR,12,L,12,L,4,L,4\nn\n") },
+  };
+
+  // Iterations of each microbenchmark loop, and copies of the instruction
+  // under test in its body
+  constexpr int64_t MicroIterations = 10000;
+  constexpr size_t MicroUnroll = 16;
+
+  /// A loop running one instruction MicroUnroll times per iteration, then
+  /// counting down and jumping back. body(pc, data, i) is the i-th copy at
+  /// pc, with three scratch words (3, 5, 0) at data, which is also the
+  /// relative base.
+  const auto microbenchmark = [](const char* name, const auto& body, std::vector<int64_t> inputs = {}) {
+    const size_t length = body(0, 0, 0).size();
+    const size_t loop = 2;
+    const size_t counter = loop + MicroUnroll * length + 7 + 1;
+    const size_t data = counter + 1;
+
+    std::vector<int64_t> words = { 109, static_cast<int64_t>(data) };
+    for (size_t i = 0; i < MicroUnroll; i++) {
+      const auto insn = body(words.size(), data, i);
+      words.insert(words.end(), insn.begin(), insn.end());
+    }
+    const auto c = static_cast<int64_t>(counter);
+    words.insert(words.end(), { 1001, c, -1, c, 1005, c, static_cast<int64_t>(loop), 99, MicroIterations, 3, 5, 0 });
+
+    std::string text;
+    for (const auto w : words) {
+      text += (text.empty() ? "" : ",") + std::to_string(w);
+    }
+    return Workload{ name, nullptr, { }, std::move(inputs), nullptr, text };
+  };
+
+  using Words = std::vector<int64_t>;
+
+  const std::vector<Workload> Microbenchmarks = {
+    microbenchmark("add", [](size_t, size_t d, size_t) { return Words{ 1, int64_t(d), int64_t(d + 1), int64_t(d + 2) }; }),
+    microbenchmark("add relative", [](size_t, size_t, size_t) { return Words{ 22201, 0, 1, 2 }; }),
+    microbenchmark("mul", [](size_t, size_t d, size_t) { return Words{ 2, int64_t(d), int64_t(d + 1), int64_t(d + 2) }; }),
+    microbenchmark("in", [](size_t, size_t d, size_t) { return Words{ 3, int64_t(d + 2) }; },
+      Words(MicroIterations * MicroUnroll, 1)),
+    microbenchmark("out", [](size_t, size_t d, size_t) { return Words{ 4, int64_t(d) }; }),
+    microbenchmark("jnz", [](size_t pc, size_t, size_t) { return Words{ 1105, 1, int64_t(pc + 3) }; }),
+    microbenchmark("jz", [](size_t pc, size_t, size_t) { return Words{ 1106, 0, int64_t(pc + 3) }; }),
+    microbenchmark("lt", [](size_t, size_t d, size_t) { return Words{ 7, int64_t(d), int64_t(d + 1), int64_t(d + 2) }; }),
+    microbenchmark("eq", [](size_t, size_t d, size_t) { return Words{ 8, int64_t(d), int64_t(d + 1), int64_t(d + 2) }; }),
+    microbenchmark("arb", [](size_t, size_t, size_t i) { return Words{ 109, i % 2 ? -1 : 1 }; }),
+  };
+
+  const auto read_program = [](const std::string& path) {
+    std::ifstream f(path);
+    std::string s;
+    if (!f.good() || !aoc::getline(f, s)) {
+      throw std::runtime_error("Unable to read " + path);
+    }
+    return s;
+  };
+
+  /// Initialize c for a run of the workload
+  const auto setup = [](aoc19::Computer& c, const Workload& w) {
+    c.initialize();
+    for (const auto& p : w.patches) {
+      c.set_memory(p.first, p.second);
+    }
+    for (const auto i : w.inputs) {
+      c.set_input(i);
+    }
+  };
+
+  /// Run c to the end with run(outputs), answering when it waits for input
+  const auto complete = [](aoc19::Computer& c, const Workload& w, aoc19::InputOutputs& outputs, const auto& run) {
+    auto result = run(outputs);
+    while (result == aoc19::HaltCode::NeedsInput && w.respond) {
+      w.respond(c, outputs);
+      result = run(outputs);
+    }
+    if (result != aoc19::HaltCode::Halt) {
+      throw std::runtime_error(std::string(w.name) + " did not run to completion");
+    }
+  };
+
+  /// Average seconds per complete run of the workload on the given engine
+  const auto measure = [](aoc19::Computer& c, const Workload& w, Engine engine) {
+    size_t runs = 0;
+    double elapsed = 0;
+
+    c.set_run_to_completion(true);
+    while (runs < MinRuns || elapsed < MinSeconds) {
+      aoc19::InputOutputs outputs;
+
+      const auto start = Clock::now();
+      setup(c, w);
+      complete(c, w, outputs, [&](aoc19::InputOutputs& o) { return (c.*engine)(o); });
+      const auto end = Clock::now();
+
+      elapsed += std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() * 1e-9;
+      runs++;
+    }
+
+    return elapsed / runs;
+  };
+
+  /// Dispatches for one complete run of the workload, each superinstruction
+  /// counting once
+  const auto count = [](aoc19::Computer& c, const Workload& w) {
+    aoc19::InputOutputs outputs;
+    uint64_t dispatches = 0;
+    c.set_run_to_completion(true);
+    setup(c, w);
+    complete(c, w, outputs, [&](aoc19::InputOutputs& o) { return c.run_counted(o, dispatches); });
+    return dispatches;
+  };
+
+  /// Time stamp counter ticks, 0 without one
+  const auto ticks = []() -> uint64_t {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+  };
+
+  /// A workload as run() runs it in this build, averaged per run
+  class Result {
+  public:
+    const char* name;
+    const char* kind;
+    uint64_t instructions = 0;
+    uint64_t dispatches = 0;
+    /// Seconds parsing the program and building the VM
+    double load = 0;
+    /// Seconds initializing it, patching memory and queueing input
+    double setup = 0;
+    /// Seconds running it
+    double run = 0;
+    /// Time stamp counter ticks running it
+    double cycles = 0;
+
+    double instructions_per_second() const {
+      return instructions / run;
+    }
+
+    double cycles_per_instruction() const {
+      return cycles / instructions;
+    }
+  };
+
+  const auto benchmark = [](const Workload& w, const std::string& text, const char* kind) {
+    Result r{ w.name, kind };
+    {
+      aoc19::Computer c(text);
+      c.set_fusion(false);
+      r.instructions = count(c, w);
+      c.set_fusion(true);
+      r.dispatches = count(c, w);
+    }
+
+    size_t runs = 0;
+    while (runs < MinRuns || r.load + r.setup + r.run < MinSeconds) {
+      aoc19::InputOutputs outputs;
+
+      const auto t0 = Clock::now();
+      aoc19::Computer c(aoc19::Program::parse(text));
+      c.set_run_to_completion(true);
+      const auto t1 = Clock::now();
+      setup(c, w);
+      const auto t2 = Clock::now();
+      const auto c0 = ticks();
+      complete(c, w, outputs, [&c](aoc19::InputOutputs& o) { return c.run(o); });
+      const auto c1 = ticks();
+      const auto t3 = Clock::now();
+
+      r.load += std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count() * 1e-9;
+      r.setup += std::chrono::duration_cast<std::chrono::nanoseconds>(t2 - t1).count() * 1e-9;
+      r.run += std::chrono::duration_cast<std::chrono::nanoseconds>(t3 - t2).count() * 1e-9;
+      r.cycles += c1 - c0;
+      runs++;
+    }
+
+    r.load /= runs;
+    r.setup /= runs;
+    r.run /= runs;
+    r.cycles /= runs;
+    return r;
+  };
+
+  /// Every real workload and microbenchmark
+  const auto benchmark_all = [](const std::string& dir) {
+    std::vector<Result> results;
+    for (const auto& w : Workloads) {
+      results.push_back(benchmark(w, read_program(dir + "/" + w.file), "program"));
+    }
+    for (const auto& w : Microbenchmarks) {
+      results.push_back(benchmark(w, w.text, "opcode"));
+    }
+    return results;
+  };
+
+  const auto write_json = [](std::ostream& os, const std::vector<Result>& results) {
+    const bool tsc = ticks() != 0;
+    aoc19::Computer probe(std::string("99"));
+
+    os << "{\n  \"engine\": \""
+#if defined(AOC_THREADED_DISPATCH)
+      << "threaded"
+#else
+      << "switch"
+#endif
+      << "\",\n  \"jit\": " << (probe.jit_enabled() ? "true" : "false")
+      << ",\n  \"fusion\": " << (probe.fusion_enabled() ? "true" : "false")
+      << ",\n  \"memo\": " << (probe.memo().enabled() ? "true" : "false")
+      << ",\n  \"workloads\": [";
+    bool first = true;
+    for (const auto& r : results) {
+      os << (first ? "\n" : ",\n") << "    { \"name\": \"" << r.name << "\", \"kind\": \"" << r.kind << "\""
+        << ", \"instructions\": " << r.instructions << ", \"dispatches\": " << r.dispatches
+        << std::fixed << std::setprecision(3)
+        << ", \"load_us\": " << r.load * 1e6 << ", \"setup_us\": " << r.setup * 1e6 << ", \"run_us\": " << r.run * 1e6
+        << std::setprecision(0) << ", \"instructions_per_second\": " << r.instructions_per_second()
+        << ", \"cycles_per_instruction\": ";
+      if (tsc) {
+        os << std::setprecision(3) << r.cycles_per_instruction();
+      } else {
+        os << "null";
+      }
+      os << " }";
+      first = false;
+    }
+    os << "\n  ]\n}\n";
+  };
+
+  // Every noun and verb of Day2's part 2 search
+  constexpr int64_t SweepRuns = 100 * 100;
+
+  /// Day2 sweep runs per second, one scalar Computer
+  const auto sweep_scalar = [](const std::string& program) {
+    aoc19::Computer c(program);
+    c.set_jit(false);
+    const auto start = Clock::now();
+    for (int64_t k = 0; k < SweepRuns; k++) {
+      aoc19::InputOutputs outputs;
+      c.initialize(k / 100, k % 100);
+      c.run_switch(outputs);
+    }
+    const auto end = Clock::now();
+    return SweepRuns / (std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() * 1e-9);
+  };
+
+  /// Day2 sweep runs per second, lanes at a time in lockstep
+  const auto sweep_batch = [](const std::string& program, size_t lanes) {
+    aoc19::BatchComputer b(program, lanes);
+    const auto start = Clock::now();
+    for (int64_t base = 0; base < SweepRuns; base += lanes) {
+      b.initialize();
+      for (size_t l = 0; l < lanes; l++) {
+        const auto k = (base + static_cast<int64_t>(l)) % SweepRuns;
+        b.set_memory(l, 1, k / 100);
+        b.set_memory(l, 2, k % 100);
+      }
+      b.run();
+    }
+    const auto end = Clock::now();
+    return SweepRuns / (std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() * 1e-9);
+  };
+
+};
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    throw std::runtime_error("Usage: IntCodeBench <inputs directory> [--json <output>]");
+  }
+
+  const std::string dir(argv[1]);
+
+  // IntCodeBench <inputs directory> --json <output> runs the instructions
+  // per second suite alone, as this build's run() runs it
+  if (argc > 3 && ::strcmp(argv[2], "--json") == 0) {
+    std::ofstream out(argv[3]);
+    write_json(out, benchmark_all(dir));
+    if (!out.good()) {
+      std::cerr << "Unable to write " << argv[3] << std::endl;
+      return -1;
+    }
+    return 0;
+  }
+
+  std::cout << std::left << std::setw(24) << "Workload"
+    << std::right << std::setw(14) << "switch (us)"
+#if defined(__GNUC__)
+    << std::setw(16) << "threaded (us)"
+    << std::setw(10) << "speedup"
+#endif
+    << std::setw(12) << "jit (us)"
+    << std::setw(10) << "speedup"
+    << std::endl;
+
+  for (const auto& w : Workloads) {
+    aoc19::Computer c(read_program(dir + "/" + w.file));
+    c.set_jit(false);
+
+    const auto t_switch = measure(c, w, &aoc19::Computer::run_switch);
+
+    std::cout << std::left << std::setw(24) << w.name
+      << std::right << std::fixed << std::setprecision(3)
+      << std::setw(14) << t_switch * 1e6;
+#if defined(__GNUC__)
+    const auto t_threaded = measure(c, w, &aoc19::Computer::run_threaded);
+
+    std::cout << std::setw(16) << t_threaded * 1e6
+      << std::setw(9) << std::setprecision(2) << t_switch / t_threaded << "x";
+#endif
+
+    c.set_jit(true);
+    const auto t_jit = measure(c, w, &aoc19::Computer::run_switch);
+    c.set_jit(false);
+
+    std::cout << std::setprecision(3) << std::setw(12) << t_jit * 1e6
+      << std::setw(9) << std::setprecision(2) << t_switch / t_jit << "x";
+    std::cout << std::endl;
+  }
+
+  std::cout << std::endl << std::left << std::setw(24) << "Fusion"
+    << std::right << std::setw(14) << "instructions"
+    << std::setw(12) << "dispatches"
+    << std::setw(10) << "saved"
+    << std::setw(14) << "unfused (us)"
+    << std::setw(12) << "fused (us)"
+    << std::setw(10) << "speedup"
+    << std::endl;
+
+  for (const auto& w : Workloads) {
+    aoc19::Computer c(read_program(dir + "/" + w.file));
+    c.set_jit(false);
+
+    c.set_fusion(false);
+    const auto instructions = count(c, w);
+    const auto t_unfused = measure(c, w, &aoc19::Computer::run_switch);
+    c.set_fusion(true);
+    const auto dispatches = count(c, w);
+    const auto t_fused = measure(c, w, &aoc19::Computer::run_switch);
+
+    std::cout << std::left << std::setw(24) << w.name
+      << std::right << std::setw(14) << instructions
+      << std::setw(12) << dispatches
+      << std::fixed << std::setprecision(1)
+      << std::setw(9) << 100.0 * (instructions - dispatches) / instructions << "%"
+      << std::setprecision(3)
+      << std::setw(14) << t_unfused * 1e6
+      << std::setw(12) << t_fused * 1e6
+      << std::setw(9) << std::setprecision(2) << t_unfused / t_fused << "x"
+      << std::endl;
+  }
+
+  std::cout << std::endl << std::left << std::setw(24) << "Suite"
+    << std::right << std::setw(14) << "instructions"
+    << std::setw(12) << "load (us)"
+    << std::setw(12) << "setup (us)"
+    << std::setw(12) << "run (us)"
+    << std::setw(12) << "Minsn/s"
+    << std::setw(8) << "CPI"
+    << std::endl;
+
+  for (const auto& r : benchmark_all(dir)) {
+    std::cout << std::left << std::setw(24) << (std::string(r.kind) == "opcode" ? std::string("  ") + r.name : r.name)
+      << std::right << std::setw(14) << r.instructions
+      << std::fixed << std::setprecision(3)
+      << std::setw(12) << r.load * 1e6
+      << std::setw(12) << r.setup * 1e6
+      << std::setw(12) << r.run * 1e6
+      << std::setprecision(1) << std::setw(12) << r.instructions_per_second() * 1e-6
+      << std::setprecision(2) << std::setw(8) << r.cycles_per_instruction()
+      << std::endl;
+  }
+
+  const auto day2 = read_program(dir + "/Day2.txt");
+  const auto scalar = sweep_scalar(day2);
+  std::cout << std::endl << std::left << std::setw(24) << "Day2 sweep"
+    << std::right << std::setw(14) << "runs/s" << std::setw(10) << "speedup" << std::endl;
+  std::cout << std::left << std::setw(24) << "  scalar"
+    << std::right << std::setprecision(0) << std::setw(14) << scalar << std::endl;
+  for (const size_t lanes : { 4, 8, 16, 32, 64 }) {
+    const auto batch = sweep_batch(day2, lanes);
+    std::cout << std::left << std::setw(24) << "  batch x" + std::to_string(lanes)
+      << std::right << std::setprecision(0) << std::setw(14) << batch
+      << std::setw(9) << std::setprecision(2) << batch / scalar << "x" << std::endl;
+  }
+
+  return 0;
+}
@@ -0,0 +1,22 @@
+# Differential test of the JIT against the interpreter: run a day with
+# AOC_JIT=0 and AOC_JIT=1 and compare everything it prints but timings
+#
+#   cmake -DDAY=<binary> -DINPUT=<input> -P jit_diff.cmake
+
+foreach(jit 0 1)
+  execute_process(
+    COMMAND ${CMAKE_COMMAND} -E env AOC_JIT=${jit} ${DAY} ${INPUT}
+    RESULT_VARIABLE result
+    OUTPUT_VARIABLE output
+    ERROR_VARIABLE output)
+  string(REGEX REPLACE "Elapsed[^\n]*\n" "" output "${output}")
+  set(result_${jit} "${result}")
+  set(output_${jit} "${output}")
+endforeach()
+
+if (NOT result_0 EQUAL 0)
+  message(FATAL_ERROR "${DAY} failed in the interpreter (${result_0}):\n${output_0}")
+endif()
+if (NOT result_1 STREQUAL result_0 OR NOT output_1 STREQUAL output_0)
+  message(FATAL_ERROR "${DAY} differs with AOC_JIT=1 (${result_1}):\n${output_1}\ninterpreted:\n${output_0}")
+endif()
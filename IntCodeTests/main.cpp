@@ -0,0 +1,183 @@
+#include "aoc/helpers.h"
+#include "aoc/aot.h"
+#include "aoc/scheduler.h"
+#include <functional>
+#include <map>
+
+AOC19_AOT_PROGRAM(SelfModify)
+
+namespace {
+
+  size_t failures = 0;
+
+  const auto check = [](bool ok, const std::string& what) {
+    if (!ok) {
+      std::cerr << "FAILED: " << what << std::endl;
+      failures++;
+    }
+  };
+
+  /// SelfModify.txt makes a computed jump the translator can't follow, so
+  /// the interpreter runs the code there. It patches the operand of a
+  /// translated OUT 111 to 222, then jumps back to a translated IN and
+  /// waits for input. The next run() must stay in the interpreter rather
+  /// than go back to native code which still outputs 111.
+  void aot_self_modify() {
+    aoc19::AotComputer<aoc19::aot::SelfModify> c(true);
+    c.initialize();
+
+    aoc19::InputOutputs o;
+    check(c.run(o) == aoc19::HaltCode::NeedsInput, "waits for input after patching");
+    c.set_input(1);
+    check(c.run(o) == aoc19::HaltCode::HasOutput, "patched OUT writes");
+    check(!o.empty() && o.front() == 222, "patched OUT writes the patched value");
+    check(c.run(o) == aoc19::HaltCode::Halt, "halts");
+  }
+
+  /// set_memory() on an AOT computer is traced like any other patch, and
+  /// a patch to translated code is what runs
+  void aot_set_memory() {
+    aoc19::AotComputer<aoc19::aot::SelfModify> c(true);
+    c.initialize();
+    const auto trace = std::make_shared<aoc19::TraceRecorder>(c.program());
+    c.set_trace(trace);
+    c.set_memory(12, 333);
+
+    const auto records = trace->drain();
+    check(records.size() == 1 && records[0].event == aoc19::TraceEvent::Patch &&
+      records[0].address == 12 && records[0].value == 333, "patch is traced");
+
+    aoc19::InputOutputs o;
+    check(c.run(o) == aoc19::HaltCode::NeedsInput, "waits for input after patching");
+    c.set_input(1);
+    check(c.run(o) == aoc19::HaltCode::HasOutput, "patched OUT writes");
+    check(!o.empty() && o.front() == 333, "writes the value patched in with set_memory()");
+  }
+
+  /// A VM whose output handler threw is retired, so running the scheduler
+  /// again finishes the others instead of waiting for it forever
+  void scheduler_rerun_after_throw() {
+    aoc19::Scheduler s(2);
+    s.add(aoc19::Computer(std::string("104,1,99")));
+    s.add(aoc19::Computer(std::string("104,2,99")));
+    s.set_output_handler([](aoc19::Scheduler::Id, int64_t value) {
+      if (value == 1) {
+        throw std::runtime_error("handler failed");
+      }
+    });
+
+    bool threw = false;
+    try {
+      s.run();
+    } catch (const std::runtime_error&) {
+      threw = true;
+    }
+    check(threw, "run() rethrows what the handler threw");
+
+    s.run();
+    check(s.halted(0) && s.halted(1), "second run() finishes");
+  }
+
+  /// send() from a worker of another scheduler, with more workers than the
+  /// receiving one has queues
+  void scheduler_send_across() {
+    aoc19::Scheduler sink(1);
+    // Echo every input
+    const auto echo = sink.add(aoc19::Computer(std::string("3,100,4,100,1105,1,0")));
+    sink.run();
+
+    aoc19::Scheduler source(4);
+    for (int64_t i = 0; i < 8; i++) {
+      source.add(aoc19::Computer("104," + std::to_string(i) + ",99"));
+    }
+    source.set_output_handler([&](aoc19::Scheduler::Id, int64_t value) { sink.send(echo, value); });
+    source.run();
+    sink.run();
+
+    check(sink.outputs(echo).size() == 8, "every value sent is echoed");
+  }
+
+  /// Reads two inputs into the operands of two OUTs on another page, which
+  /// nothing has decoded yet, then jumps there
+  aoc19::Computer two_page_echo() {
+    aoc19::Memory program{ 3, 1001, 3, 1003, 1105, 1, 1000 };
+    program.resize(1000, 0);
+    program.insert(program.end(), { 104, 0, 104, 0, 99 });
+    return aoc19::Computer(aoc19::Program(program));
+  }
+
+  std::vector<int64_t> drain(aoc19::InputOutputs& o) {
+    std::vector<int64_t> values;
+    for (; !o.empty(); o.pop()) {
+      values.push_back(o.front());
+    }
+    return values;
+  }
+
+  /// Forks sharing memory and decoded instructions each see their own
+  /// stores, including to code the other one decodes first, and go on
+  /// seeing them once the memory stops being shared
+  void fork_copy_on_write() {
+    auto parent = two_page_echo();
+    parent.initialize();
+    auto child = parent.fork();
+
+    aoc19::InputOutputs o;
+    child.set_input(7);
+    check(child.run(o) == aoc19::HaltCode::NeedsInput, "fork waits for its second input");
+    check(parent.get(1001) == 0 && child.get(1001) == 7, "fork's store is its own");
+
+    parent.set_input(5);
+    parent.set_input(6);
+    check(parent.run(o) == aoc19::HaltCode::Halt, "parent halts");
+    check(drain(o) == std::vector<int64_t>{ 5, 6 }, "parent runs its own code");
+
+    // Nothing shares the fork's memory now
+    parent.initialize();
+    child.set_input(8);
+    check(child.run(o) == aoc19::HaltCode::Halt, "fork halts");
+    check(drain(o) == std::vector<int64_t>{ 7, 8 }, "fork runs its own code");
+    check(child.get(1001) == 7 && child.get(1003) == 8 && child.get(0) == 3, "fork keeps its stores");
+    check(parent.get(1001) == 0, "parent is reset");
+  }
+
+  /// A patch to the body of a memoized function after initialize(), before
+  /// anything has decoded it again, drops the results it recorded
+  void memo_patch_after_initialize() {
+    // main calls f(5), which returns its argument plus the immediate at 22
+    aoc19::Computer c(std::string("109,100,21101,5,0,1,21101,13,0,0,1105,1,20,204,1,99,0,0,0,0,21201,1,7,1,2105,1,0"));
+    c.set_memoize(true);
+    check(c.memo().functions().size() == 1, "finds the function");
+
+    aoc19::InputOutputs o;
+    c.initialize();
+    check(c.run(o) == aoc19::HaltCode::Halt && drain(o) == std::vector<int64_t>{ 12 }, "f(5) is 12");
+
+    c.initialize();
+    c.set_memory(22, 100);
+    check(c.run(o) == aoc19::HaltCode::Halt && drain(o) == std::vector<int64_t>{ 105 }, "patched f(5) is 105");
+    check(c.memo().stats().hits == 0, "nothing replayed from before the patch");
+  }
+
+  const std::map<std::string, std::function<void()>> Tests = {
+    { "memo_patch_after_initialize", memo_patch_after_initialize },
+    { "fork_copy_on_write", fork_copy_on_write },
+    { "aot_self_modify", aot_self_modify },
+    { "aot_set_memory", aot_set_memory },
+    { "scheduler_rerun_after_throw", scheduler_rerun_after_throw },
+    { "scheduler_send_across", scheduler_send_across },
+  };
+};
+
+int main(int argc, char** argv) {
+  if (argc < 2 || !Tests.count(argv[1])) {
+    std::cerr << "Usage: IntCodeTests <test>, one of:" << std::endl;
+    for (const auto& t : Tests) {
+      std::cerr << "  " << t.first << std::endl;
+    }
+    return -1;
+  }
+
+  Tests.at(argv[1])();
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include "computer.h"
+
+namespace aoc19 {
+
+/// Program a translation unit generated by `IntCode --aot` was built from.
+/// code[address] is set for every word of a translated instruction.
+class AotImage {
+public:
+    const char* source;
+    const uint8_t* code;
+    size_t code_size;
+};
+
+/*
+A Computer whose run() was translated ahead of time to C++ by `IntCode --aot`.
+Tag names the program, the generated translation unit provides the
+AotComputer<Tag>::Image and AotComputer<Tag>::run specialisations.
+
+Once a translated instruction is overwritten the compiled code no longer
+matches memory, so run() falls back to the interpreter until the next
+initialize(). The translated words are marked in the code map, so this
+holds for stores made by the interpreter too. Computed jumps to a pc with
+no translation also go to the interpreter.
+*/
+template <typename Tag>
+class AotComputer
+    : public Computer
+{
+public:
+    AotComputer()
+        : AotComputer(false)
+    {
+    }
+
+    AotComputer(bool pause_on_output)
+        : Computer(Image.source, pause_on_output)
+    {
+        _translated = Image.code;
+        _translated_size = Image.code_size;
+    }
+
+    /// Whether program is the one this class was generated from
+    static bool matches(const std::string& program) {
+        static const Program image = Program::parse(Image.source);
+        return Program::parse(program) == image;
+    }
+
+    void set_memory(size_t address, int64_t value) {
+        // Patching translated code keeps run() in the interpreter, even
+        // before initialize() has marked the code map
+        if (address < _translated_size && _translated[address]) {
+            _translated_written = true;
+        }
+        Computer::set_memory(address, value);
+    }
+
+    AotComputer fork() const {
+        return *this;
+    }
+
+    HaltCode run(const InputOutputs& inputs, InputOutputs& outputs) {
+        _inputs = inputs;
+        return run(outputs);
+    }
+
+    /// Generated
+    HaltCode run(InputOutputs& outputs);
+
+protected:
+    /// Generated
+    static const AotImage Image;
+
+    /// Store val, returning true when the compiled code can no longer be used
+    bool write(size_t address, int64_t val) {
+        store(address, val);
+        return _translated_written;
+    }
+
+    /// Carry on from the program counter in the interpreter
+    HaltCode interpret(InputOutputs& outputs) {
+        return Computer::run(outputs);
+    }
+};
+
+};
+
+/// Declare the specialisations for a program translated with
+/// `IntCode --aot <program> <output> Name`, use as aoc19::AotComputer<aoc19::aot::Name>
+#define AOC19_AOT_PROGRAM(Name) \
+    namespace aoc19 { \
+        namespace aot { \
+            struct Name; \
+        }; \
+        template <> const AotImage AotComputer<aot::Name>::Image; \
+        template <> HaltCode AotComputer<aot::Name>::run(InputOutputs& outputs); \
+    }
@@ -0,0 +1,387 @@
+#pragma once
+
+#include "computer.h"
+
+#include <array>
+#include <stdexcept>
+#include <vector>
+
+namespace aoc19 {
+
+/*
+Runs many instances (lanes) of one program in lockstep, for sweeps like
+Day2's noun and verb search.
+
+Memory is structure-of-arrays, word a of every lane is contiguous at
+a * lanes(), so an instruction executed by all the lanes which are at the
+same pc with the same instruction word is a handful of loops over whole
+rows, which the compiler turns into SIMD. Operand words which differ between
+lanes (Day2's noun and verb) or relative addressing fall back to a gather or
+scatter for that operand. Each step runs the group with the lowest pc, lanes
+which branch away wait there and are picked up again when the rest reach the
+same pc.
+
+Lanes run to completion, outputs are collected per lane, and a lane which
+needs input and has none waits in LaneState::NeedsInput until set_input()
+and run().
+Nothing is cached, so self-modifying code just works.
+*/
+class BatchComputer
+{
+public:
+    enum class LaneState {
+        Running = 0,
+        NeedsInput,
+        Halted,
+    };
+
+    /// Words a lane may address before memory is considered runaway
+    static constexpr size_t MaxWords = 1 << 24;
+
+    BatchComputer(const std::string& program, size_t lanes)
+        : BatchComputer(Program::load(program), lanes)
+    {
+    }
+
+    BatchComputer(const Program& program, size_t lanes)
+        : _program(program)
+        , _lanes(lanes)
+        , _words(0)
+        , _pc(lanes)
+        , _relative_base(lanes)
+        , _state(lanes)
+        , _inputs(lanes)
+        , _outputs(lanes)
+        , _mask(lanes)
+        , _a(lanes)
+        , _b(lanes)
+        , _steps(0)
+        , _instructions(0)
+    {
+        if (!lanes) {
+            throw std::invalid_argument("BatchComputer needs at least one lane");
+        }
+        for (auto& o : _operands) {
+            o.resize(lanes);
+        }
+        initialize();
+    }
+
+    size_t lanes() const {
+        return _lanes;
+    }
+
+    /// Every lane back to the program image at pc 0
+    void initialize() {
+        _words = _program.size();
+        _memory.resize(_words * _lanes);
+        for (size_t a = 0; a < _words; a++) {
+            std::fill_n(&_memory[a * _lanes], _lanes, _program[a]);
+        }
+        std::fill(_pc.begin(), _pc.end(), 0);
+        std::fill(_relative_base.begin(), _relative_base.end(), 0);
+        std::fill(_state.begin(), _state.end(), LaneState::Running);
+        for (size_t l = 0; l < _lanes; l++) {
+            _inputs[l] = InputOutputs();
+            _outputs[l] = InputOutputs();
+        }
+    }
+
+    /// Patch address in every lane to the same value
+    void set_memory(size_t address, int64_t value) {
+        auto row = writable_row(address);
+        std::fill_n(row, _lanes, value);
+    }
+
+    void set_memory(size_t lane, size_t address, int64_t value) {
+        writable_row(address)[lane] = value;
+    }
+
+    void set_input(size_t lane, int64_t value) {
+        _inputs[lane].push(value);
+        if (_state[lane] == LaneState::NeedsInput) {
+            _state[lane] = LaneState::Running;
+        }
+    }
+
+    int64_t get(size_t lane, size_t address) const {
+        return address < _words ? _memory[address * _lanes + lane] : 0;
+    }
+
+    InputOutputs& outputs(size_t lane) {
+        return _outputs[lane];
+    }
+
+    LaneState get_state(size_t lane) const {
+        return _state[lane];
+    }
+
+    size_t get_pc(size_t lane) const {
+        return _pc[lane];
+    }
+
+    /// Groups executed, one per instruction however many lanes took part
+    uint64_t steps() const {
+        return _steps;
+    }
+
+    /// Instructions executed, summed over the lanes
+    uint64_t instructions() const {
+        return _instructions;
+    }
+
+    /// Run every lane until it halts or needs input it doesn't have
+    void run() {
+        while (true) {
+            // The lowest pc goes first, so that lanes which branched
+            // ahead wait for the rest to catch up
+            size_t leader = SIZE_MAX;
+            for (size_t l = 0; l < _lanes; l++) {
+                if (_state[l] == LaneState::Running && (leader == SIZE_MAX || _pc[l] < _pc[leader])) {
+                    leader = l;
+                }
+            }
+            if (leader == SIZE_MAX) {
+                return;
+            }
+            step(leader);
+        }
+    }
+
+private:
+    enum Mode {
+        Position = 0,
+        Immediate,
+        Relative,
+    };
+
+    Program _program;
+    size_t _lanes;
+    size_t _words;
+    /// Word a of lane l is _memory[a * _lanes + l]
+    Memory _memory;
+    std::vector<size_t> _pc;
+    std::vector<size_t> _relative_base;
+    std::vector<LaneState> _state;
+    std::vector<InputOutputs> _inputs;
+    std::vector<InputOutputs> _outputs;
+
+    // Per step scratch, one entry per lane
+    std::vector<uint8_t> _mask;
+    Memory _a;
+    Memory _b;
+    /// Each lane's operand words
+    std::array<Memory, 3> _operands;
+
+    uint64_t _steps;
+    uint64_t _instructions;
+
+    int64_t* writable_row(size_t address) {
+        if (address >= _words) {
+            if (address >= MaxWords) {
+                throw std::runtime_error("Address out of range for batch memory");
+            }
+            _words = address + 1;
+            _memory.resize(_words * _lanes, 0);
+        }
+        return &_memory[address * _lanes];
+    }
+
+    int64_t read(size_t lane, size_t address) const {
+        return get(lane, address);
+    }
+
+    /// One parameter of the instruction being executed
+    class Parameter {
+    public:
+        int64_t mode;
+        /// The leader's operand word
+        int64_t word;
+        /// Whether every lane in the group has the same operand word
+        bool uniform;
+        const Memory& words;
+    };
+
+    /// Operand values of a parameter for the lanes in the group
+    void load(const Parameter& p, Memory& out) {
+        if (p.mode == Immediate) {
+            std::copy(p.words.begin(), p.words.end(), out.begin());
+        } else if (p.mode == Position && p.uniform) {
+            if (static_cast<size_t>(p.word) < _words) {
+                const auto row = &_memory[p.word * _lanes];
+                std::copy(row, row + _lanes, out.begin());
+            } else {
+                std::fill(out.begin(), out.end(), 0);
+            }
+        } else {
+            const bool relative = p.mode == Relative;
+            for (size_t l = 0; l < _lanes; l++) {
+                if (_mask[l]) {
+                    out[l] = read(l, (relative ? _relative_base[l] : 0) + p.words[l]);
+                }
+            }
+        }
+    }
+
+    /// Write values to the output parameter for the lanes in the group
+    void store(const Parameter& p, const Memory& values) {
+        if (p.mode == Position && p.uniform) {
+            auto row = writable_row(p.word);
+            for (size_t l = 0; l < _lanes; l++) {
+                row[l] = _mask[l] ? values[l] : row[l];
+            }
+            return;
+        }
+        const bool relative = p.mode == Relative;
+        for (size_t l = 0; l < _lanes; l++) {
+            if (_mask[l]) {
+                writable_row((relative ? _relative_base[l] : 0) + p.words[l])[l] = values[l];
+            }
+        }
+    }
+
+    /// Execute the instruction at the leader's pc for every lane there with
+    /// the same instruction words
+    void step(size_t leader) {
+        const auto pc = _pc[leader];
+        const auto raw = read(leader, pc);
+        const auto opcode = raw % 100;
+        const auto count = parameter_count(opcode);
+        if (!count && opcode != 99) {
+            throw InvalidOpcode(pc, opcode);
+        }
+
+        int64_t modes[3] = { 0, 0, 0 };
+        auto m = raw / 100;
+        for (size_t i = 0; i < count; i++) {
+            modes[i] = m % 10;
+            m /= 10;
+            if (modes[i] > Relative) {
+                throw std::runtime_error("Invalid parameter mode");
+            }
+        }
+        if ((count == 3 && modes[2] == Immediate) || (opcode == 3 && modes[0] == Immediate)) {
+            throw std::runtime_error("Immediate mode not supported for output address");
+        }
+
+        size_t active = 0;
+        const auto code = pc < _words ? &_memory[pc * _lanes] : nullptr;
+        for (size_t l = 0; l < _lanes; l++) {
+            const bool same = _state[l] == LaneState::Running && _pc[l] == pc && code[l] == raw;
+            _mask[l] = same;
+            active += same;
+        }
+        _steps++;
+        _instructions += active;
+
+        bool uniform[3] = { true, true, true };
+        for (size_t i = 0; i < count; i++) {
+            auto& words = _operands[i];
+            if (pc + i + 1 < _words) {
+                const auto row = &_memory[(pc + i + 1) * _lanes];
+                std::copy(row, row + _lanes, words.begin());
+            } else {
+                std::fill(words.begin(), words.end(), 0);
+            }
+            const auto word = words[leader];
+            size_t differ = 0;
+            for (size_t l = 0; l < _lanes; l++) {
+                differ += _mask[l] && words[l] != word;
+            }
+            uniform[i] = !differ;
+        }
+        const auto parameter = [&](size_t i) {
+            return Parameter{ modes[i], _operands[i][leader], uniform[i], _operands[i] };
+        };
+
+        switch (opcode) {
+            case 1: case 2: case 7: case 8:
+                load(parameter(0), _a);
+                load(parameter(1), _b);
+                switch (opcode) {
+                    case 1:
+                        combine([](int64_t a, int64_t b) { return a + b; });
+                        break;
+                    case 2:
+                        combine([](int64_t a, int64_t b) { return a * b; });
+                        break;
+                    case 7:
+                        combine([](int64_t a, int64_t b) -> int64_t { return a < b; });
+                        break;
+                    default:
+                        combine([](int64_t a, int64_t b) -> int64_t { return a == b; });
+                        break;
+                }
+                store(parameter(2), _a);
+                advance(4);
+                break;
+            case 3:
+                for (size_t l = 0; l < _lanes; l++) {
+                    if (!_mask[l]) {
+                        continue;
+                    }
+                    if (_inputs[l].empty()) {
+                        _state[l] = LaneState::NeedsInput;
+                        _mask[l] = false;
+                        continue;
+                    }
+                    _a[l] = _inputs[l].front(); _inputs[l].pop();
+                }
+                store(parameter(0), _a);
+                advance(2);
+                break;
+            case 4:
+                load(parameter(0), _a);
+                for (size_t l = 0; l < _lanes; l++) {
+                    if (_mask[l]) {
+                        _outputs[l].push(_a[l]);
+                    }
+                }
+                advance(2);
+                break;
+            case 5: case 6:
+                load(parameter(0), _a);
+                load(parameter(1), _b);
+                for (size_t l = 0; l < _lanes; l++) {
+                    if (_mask[l]) {
+                        const bool taken = (_a[l] != 0) == (opcode == 5);
+                        _pc[l] = taken ? static_cast<size_t>(_b[l]) : pc + 3;
+                    }
+                }
+                break;
+            case 9:
+                load(parameter(0), _a);
+                for (size_t l = 0; l < _lanes; l++) {
+                    if (_mask[l]) {
+                        _relative_base[l] += _a[l];
+                    }
+                }
+                advance(2);
+                break;
+            case 99:
+                for (size_t l = 0; l < _lanes; l++) {
+                    if (_mask[l]) {
+                        _state[l] = LaneState::Halted;
+                    }
+                }
+                break;
+        }
+    }
+
+    /// _a = f(_a, _b) across every lane, those outside the group are
+    /// thrown away by store()
+    template <typename F>
+    void combine(F f) {
+        for (size_t l = 0; l < _lanes; l++) {
+            _a[l] = f(_a[l], _b[l]);
+        }
+    }
+
+    void advance(size_t length) {
+        for (size_t l = 0; l < _lanes; l++) {
+            _pc[l] += _mask[l] ? length : 0;
+        }
+    }
+};
+
+};
@@ -0,0 +1,465 @@
+#pragma once
+
+#include "computer.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#if AOC_HAS_MMAP
+#include <sys/file.h>
+#endif
+
+namespace aoc19 {
+
+/// What a cached run did
+class CachedRun {
+public:
+    HaltCode result = HaltCode::Error;
+    std::vector<int64_t> outputs;
+    /// Final values of the cells asked for, in the same order
+    std::vector<int64_t> cells;
+};
+
+/*
+Results of whole IntCode runs kept on disk, so running a day again with the
+same input doesn't run anything.
+
+A run is fully determined by the program, the memory patched after
+initialize() and the inputs queued, so those (with the cells wanted back)
+are the key, and what it outputs and the cells' final values the result.
+The program is keyed on its hash (Trace::hash()), so a changed program
+never finds the results of the old one. Only runs which halt are kept.
+
+The file is mapped shared, read-write, and locked while it is written, so
+several processes (and threads) can use it at once. It never shrinks and
+records are never changed once a slot points at them, so lookups don't
+lock. The generation is a sequence lock around starting over: odd while
+the table is being emptied, even again once it is, so a lookup which saw
+it odd, or changed by the time it had read a record, reads again.
+
+    0   8   "AOC19RC\0"
+    8   4   version
+    12  4   generation
+    16  8   slots in the hash table
+    24  8   end of the last record
+    32  8   records
+    40  16 * slots  hash table, key hash then record offset (0 == empty)
+
+then the records, all words int64 little-endian:
+
+    key hash, program hash, program words, halt code,
+    patch count, input count, cell count, output count,
+    patches (address, value), inputs, cell addresses, cell values, outputs
+
+Once the table is three quarters full it is emptied and the file starts
+over.
+*/
+class ResultCache
+{
+public:
+    static constexpr char Magic[8] = { 'A', 'O', 'C', '1', '9', 'R', 'C', '\0' };
+    static constexpr uint32_t Version = 1;
+    static constexpr uint64_t HeaderSize = 40;
+    static constexpr uint64_t DefaultSlots = 1 << 16;
+
+    using Patches = std::vector<std::pair<size_t, int64_t>>;
+
+    explicit ResultCache(const std::string& path, uint64_t slots = DefaultSlots)
+        : _path(path)
+    {
+#if AOC_HAS_MMAP
+        if (!Program::is_little_endian()) {
+            throw std::runtime_error("The result cache needs a little-endian machine");
+        }
+        _fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (_fd < 0) {
+            throw std::runtime_error("Unable to open " + path);
+        }
+        Lock lock(_fd);
+        struct stat st;
+        if (::fstat(_fd, &st) != 0) {
+            throw std::runtime_error("Unable to open " + path);
+        }
+        if (static_cast<uint64_t>(st.st_size) < HeaderSize || !valid_header()) {
+            create(slots);
+        } else {
+            remap();
+        }
+#else
+        (void)slots;
+        throw std::runtime_error("The result cache needs mmap");
+#endif
+    }
+
+    ResultCache(const ResultCache&) = delete;
+    ResultCache& operator=(const ResultCache&) = delete;
+
+    ~ResultCache() {
+#if AOC_HAS_MMAP
+        unmap();
+        if (_fd >= 0) {
+            ::close(_fd);
+        }
+#endif
+    }
+
+    /// A cache in the file named by AOC_CACHE, or none if it isn't set
+    static std::shared_ptr<ResultCache> from_environment() {
+        const char* path = std::getenv("AOC_CACHE");
+        if (!path || !path[0]) {
+            return nullptr;
+        }
+        return std::make_shared<ResultCache>(path);
+    }
+
+    /// Initialize c, patch memory, queue inputs and run it to completion,
+    /// returning its outputs and the final values of cells, unless the same
+    /// run has been cached
+    CachedRun run(Computer& c, const Patches& patches, const std::vector<int64_t>& inputs,
+            const std::vector<size_t>& cells = {}) {
+        const auto key = make_key(c.program(), patches, inputs, cells);
+        if (auto found = find(key)) {
+            _hits++;
+            return std::move(*found);
+        }
+
+        c.initialize();
+        for (const auto& p : patches) {
+            c.set_memory(p.first, p.second);
+        }
+        for (const auto i : inputs) {
+            c.set_input(i);
+        }
+        c.set_run_to_completion(true);
+
+        CachedRun run;
+        InputOutputs outputs;
+        run.result = c.run(outputs);
+        for (; !outputs.empty(); outputs.pop()) {
+            run.outputs.push_back(outputs.front());
+        }
+        for (const auto a : cells) {
+            run.cells.push_back(c.get(a));
+        }
+        if (run.result == HaltCode::Halt) {
+            store(key, run);
+        }
+        return run;
+    }
+
+    /// Runs answered from the cache by this process
+    uint64_t hits() const {
+        return _hits;
+    }
+
+private:
+    class Key {
+    public:
+        uint64_t hash = 0;
+        /// Everything after the key hash up to the output count, then the
+        /// patches, inputs and cell addresses
+        std::vector<int64_t> header;
+        std::vector<int64_t> words;
+    };
+
+    /// Words before the patches in a record
+    static constexpr size_t RecordHeader = 8;
+
+    /// Lookups tried without the file lock before waiting for it
+    static constexpr size_t MaxReads = 64;
+
+    std::string _path;
+    std::mutex _lock;
+    int _fd = -1;
+    uint8_t* _base = nullptr;
+    uint64_t _length = 0;
+    std::atomic<uint64_t> _hits{ 0 };
+    const int64_t* _program = nullptr;
+    size_t _program_size = 0;
+    uint64_t _program_hash = 0;
+
+    /// Hash of the program last asked about, most runs are of the same one
+    uint64_t get_program_hash(const Program& program) {
+        std::lock_guard<std::mutex> guard(_lock);
+        if (program.data() != _program || program.size() != _program_size) {
+            _program = program.data();
+            _program_size = program.size();
+            _program_hash = Trace::hash(program);
+        }
+        return _program_hash;
+    }
+
+    Key make_key(const Program& program, const Patches& patches, const std::vector<int64_t>& inputs,
+            const std::vector<size_t>& cells) {
+        Key key;
+        key.header = { static_cast<int64_t>(get_program_hash(program)), static_cast<int64_t>(program.size()), 0,
+            static_cast<int64_t>(patches.size()), static_cast<int64_t>(inputs.size()), static_cast<int64_t>(cells.size()) };
+        for (const auto& p : patches) {
+            key.words.push_back(static_cast<int64_t>(p.first));
+            key.words.push_back(p.second);
+        }
+        key.words.insert(key.words.end(), inputs.begin(), inputs.end());
+        for (const auto a : cells) {
+            key.words.push_back(static_cast<int64_t>(a));
+        }
+
+        uint64_t h = 0xcbf29ce484222325ull;
+        const auto mix = [&](int64_t w) {
+            h = (h ^ static_cast<uint64_t>(w)) * 0x100000001b3ull;
+            h ^= h >> 31;
+        };
+        for (const auto w : key.header) {
+            mix(w);
+        }
+        for (const auto w : key.words) {
+            mix(w);
+        }
+        // 0 marks an empty slot
+        key.hash = h ? h : 1;
+        return key;
+    }
+
+#if AOC_HAS_MMAP
+    /// flock() for the lifetime of the object, so other processes see
+    /// whole records
+    class Lock {
+    public:
+        explicit Lock(int fd, int operation = LOCK_EX)
+            : _fd(fd)
+        {
+            ::flock(_fd, operation);
+        }
+
+        ~Lock() {
+            ::flock(_fd, LOCK_UN);
+        }
+
+    private:
+        int _fd;
+    };
+
+    uint64_t word(uint64_t offset) const {
+        uint64_t v;
+        ::memcpy(&v, _base + offset, sizeof(v));
+        return v;
+    }
+
+    void set_word(uint64_t offset, uint64_t v) {
+        ::memcpy(_base + offset, &v, sizeof(v));
+    }
+
+    uint64_t slots() const {
+        return word(16);
+    }
+
+    bool valid_header() {
+        uint8_t header[HeaderSize];
+        if (::pread(_fd, header, sizeof(header), 0) != static_cast<ssize_t>(sizeof(header)) ||
+                ::memcmp(header, Magic, sizeof(Magic)) != 0) {
+            return false;
+        }
+        uint32_t version;
+        uint32_t generation;
+        ::memcpy(&version, header + 8, sizeof(version));
+        ::memcpy(&generation, header + 12, sizeof(generation));
+        // Odd if a process died starting over
+        return version == Version && generation % 2 == 0;
+    }
+
+    uint32_t generation() const {
+        return __atomic_load_n(reinterpret_cast<const uint32_t*>(_base + 12), __ATOMIC_ACQUIRE);
+    }
+
+    /// Start an empty cache, the caller holds the file lock
+    void create(uint64_t slots) {
+        const auto data = HeaderSize + 16 * slots;
+        struct stat st;
+        if (::fstat(_fd, &st) != 0 || (static_cast<uint64_t>(st.st_size) < data && ::ftruncate(_fd, data) != 0)) {
+            throw std::runtime_error("Unable to write " + _path);
+        }
+        remap();
+        // Odd while the table is emptied, so lookups don't trust what they
+        // read meanwhile. Already odd if a process died doing this.
+        const bool valid = ::memcmp(_base, Magic, sizeof(Magic)) == 0;
+        const uint32_t writing = (valid ? generation() : 0) | 1;
+        __atomic_store_n(reinterpret_cast<uint32_t*>(_base + 12), writing, __ATOMIC_RELAXED);
+        std::atomic_thread_fence(std::memory_order_release);
+        ::memset(_base + HeaderSize, 0, data - HeaderSize);
+        ::memcpy(_base, Magic, sizeof(Magic));
+        ::memcpy(_base + 8, &Version, sizeof(Version));
+        set_word(16, slots);
+        set_word(24, data);
+        set_word(32, 0);
+        __atomic_store_n(reinterpret_cast<uint32_t*>(_base + 12), writing + 1, __ATOMIC_RELEASE);
+    }
+
+    void unmap() {
+        if (_base) {
+            ::munmap(_base, _length);
+            _base = nullptr;
+            _length = 0;
+        }
+    }
+
+    /// Map the whole file again, after it grew
+    void remap() {
+        struct stat st;
+        if (::fstat(_fd, &st) != 0) {
+            throw std::runtime_error("Unable to map " + _path);
+        }
+        const auto length = static_cast<uint64_t>(st.st_size);
+        if (_base && length == _length) {
+            return;
+        }
+        unmap();
+        void* base = ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+        if (base == MAP_FAILED) {
+            throw std::runtime_error("Unable to map " + _path);
+        }
+        _base = static_cast<uint8_t*>(base);
+        _length = length;
+    }
+
+    /// Whether the record at offset has the key
+    bool matches(uint64_t offset, const Key& key) const {
+        const auto header_bytes = RecordHeader * 8;
+        if (offset + header_bytes > _length || word(offset) != key.hash) {
+            return false;
+        }
+        for (size_t i = 0; i < key.header.size(); i++) {
+            // The halt code is the result, not the key
+            if (i != 2 && word(offset + 8 + 8 * i) != static_cast<uint64_t>(key.header[i])) {
+                return false;
+            }
+        }
+        const auto words = offset + header_bytes;
+        return words + 8 * key.words.size() <= _length &&
+            (key.words.empty() || ::memcmp(_base + words, key.words.data(), 8 * key.words.size()) == 0);
+    }
+
+    std::optional<CachedRun> find(const Key& key) {
+        std::lock_guard<std::mutex> guard(_lock);
+        for (size_t read = 0; read < MaxReads; read++) {
+            const auto before = generation();
+            if (before % 2 == 0) {
+                auto run = lookup(key);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (generation() == before) {
+                    return run;
+                }
+            }
+            std::this_thread::yield();
+        }
+        // Still starting over, wait for whoever is doing it
+        Lock lock(_fd, LOCK_SH);
+        if (generation() % 2) {
+            return std::nullopt;
+        }
+        return lookup(key);
+    }
+
+    /// The record for key, which may be torn if the cache started over
+    /// meanwhile, the caller checks the generation
+    std::optional<CachedRun> lookup(const Key& key) {
+        const auto n = slots();
+        for (uint64_t i = 0; i < n; i++) {
+            const auto slot = HeaderSize + 16 * ((key.hash + i) % n);
+            const auto hash = __atomic_load_n(reinterpret_cast<const uint64_t*>(_base + slot), __ATOMIC_ACQUIRE);
+            if (!hash) {
+                break;
+            }
+            if (hash != key.hash) {
+                continue;
+            }
+            // Written since this was mapped
+            const auto offset = word(slot + 8);
+            if (offset + RecordHeader * 8 > _length) {
+                remap();
+            }
+            if (!matches(offset, key)) {
+                continue;
+            }
+
+            CachedRun run;
+            run.result = static_cast<HaltCode>(word(offset + 24));
+            const auto cell_count = word(offset + 48);
+            const auto output_count = word(offset + 56);
+            auto p = offset + RecordHeader * 8 + 8 * key.words.size();
+            if (cell_count > _length / 8 || output_count > _length / 8 ||
+                    p + 8 * (cell_count + output_count) > _length) {
+                return std::nullopt;
+            }
+            for (uint64_t c = 0; c < cell_count; c++, p += 8) {
+                run.cells.push_back(static_cast<int64_t>(word(p)));
+            }
+            for (uint64_t o = 0; o < output_count; o++, p += 8) {
+                run.outputs.push_back(static_cast<int64_t>(word(p)));
+            }
+            return run;
+        }
+        return std::nullopt;
+    }
+
+    void store(const Key& key, const CachedRun& run) {
+        std::lock_guard<std::mutex> guard(_lock);
+        Lock lock(_fd);
+        remap();
+
+        // Start over rather than let probing get slow
+        const auto n = slots();
+        if (4 * (word(32) + 1) > 3 * n) {
+            create(n);
+        }
+
+        std::vector<int64_t> record{ static_cast<int64_t>(key.hash) };
+        record.insert(record.end(), key.header.begin(), key.header.end());
+        record[3] = static_cast<int64_t>(run.result);
+        record.push_back(static_cast<int64_t>(run.outputs.size()));
+        record.insert(record.end(), key.words.begin(), key.words.end());
+        record.insert(record.end(), run.cells.begin(), run.cells.end());
+        record.insert(record.end(), run.outputs.begin(), run.outputs.end());
+
+        const auto offset = word(24);
+        const auto end = offset + 8 * record.size();
+        if (end > _length) {
+            unmap();
+            if (::ftruncate(_fd, std::max(end, 2 * end - HeaderSize - 16 * n)) != 0) {
+                throw std::runtime_error("Unable to write " + _path);
+            }
+            remap();
+        }
+        ::memcpy(_base + offset, record.data(), 8 * record.size());
+        set_word(24, end);
+
+        // The record is written before a slot points at it
+        for (uint64_t i = 0; i < n; i++) {
+            const auto slot = HeaderSize + 16 * ((key.hash + i) % n);
+            if (!word(slot)) {
+                set_word(slot + 8, offset);
+                __atomic_store_n(reinterpret_cast<uint64_t*>(_base + slot), key.hash, __ATOMIC_RELEASE);
+                set_word(32, word(32) + 1);
+                break;
+            }
+        }
+    }
+#else
+    std::optional<CachedRun> find(const Key&) {
+        return std::nullopt;
+    }
+
+    void store(const Key&, const CachedRun&) {
+    }
+#endif
+};
+
+};
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <thread>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+namespace aoc19 {
+
+/*
+Bounded single-producer, single-consumer channel of IntCode values, for
+wiring the output of one Computer to the input of another running on a
+different thread without locks or copies through a std::queue.
+
+One thread may push and one other thread may pop. The try_ calls never
+wait; push() and pop() spin, then yield, until there is room or a value, or
+the channel is closed. The mode says which of those a Computer uses when it
+reads or writes the channel.
+*/
+class Channel
+{
+public:
+    enum class Mode {
+        Blocking = 0,
+        NonBlocking,
+    };
+
+    static constexpr size_t CacheLine = 64;
+
+    /// capacity is rounded up to a power of two
+    explicit Channel(size_t capacity = 1024, Mode mode = Mode::Blocking)
+        : _mode(mode) {
+        size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        _mask = size - 1;
+        _buffer = std::make_unique<int64_t[]>(size);
+    }
+
+    Channel(const Channel&) = delete;
+    Channel& operator=(const Channel&) = delete;
+
+    Mode mode() const {
+        return _mode;
+    }
+
+    size_t capacity() const {
+        return _mask + 1;
+    }
+
+    /// Values waiting, only exact when neither end is in use
+    size_t size() const {
+        return _tail.load(std::memory_order_acquire) - _head.load(std::memory_order_acquire);
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    /// Producer side, false if the channel is full
+    bool try_push(int64_t value) {
+        const auto tail = _tail.load(std::memory_order_relaxed);
+        if (tail - _producer_head > _mask) {
+            _producer_head = _head.load(std::memory_order_acquire);
+            if (tail - _producer_head > _mask) {
+                return false;
+            }
+        }
+        _buffer[tail & _mask] = value;
+        _tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /// Consumer side, false if the channel is empty
+    bool try_pop(int64_t& value) {
+        const auto head = _head.load(std::memory_order_relaxed);
+        if (head == _consumer_tail) {
+            _consumer_tail = _tail.load(std::memory_order_acquire);
+            if (head == _consumer_tail) {
+                return false;
+            }
+        }
+        value = _buffer[head & _mask];
+        _head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    /// Wait for room, false if the channel was closed first
+    bool push(int64_t value) {
+        for (size_t spins = 0; !try_push(value); spins++) {
+            if (closed()) {
+                return false;
+            }
+            wait(spins);
+        }
+        return true;
+    }
+
+    /// Wait for a value, false once the channel is closed and drained
+    bool pop(int64_t& value) {
+        for (size_t spins = 0; !try_pop(value); spins++) {
+            if (closed()) {
+                // Anything pushed before the close is still delivered
+                return try_pop(value);
+            }
+            wait(spins);
+        }
+        return true;
+    }
+
+    /// No more values will be pushed, wakes up anything waiting on either end
+    void close() {
+        _closed.store(true, std::memory_order_release);
+    }
+
+    bool closed() const {
+        return _closed.load(std::memory_order_acquire);
+    }
+
+private:
+    /// Busy wait this many times before giving the core away
+    static constexpr size_t SpinLimit = 1024;
+
+    // Each end's index and its cached copy of the other end's index share a
+    // line which only that end writes
+    alignas(CacheLine) std::atomic<size_t> _head{ 0 };
+    size_t _consumer_tail = 0;
+
+    alignas(CacheLine) std::atomic<size_t> _tail{ 0 };
+    size_t _producer_head = 0;
+
+    alignas(CacheLine) std::atomic<bool> _closed{ false };
+    Mode _mode;
+    size_t _mask;
+    std::unique_ptr<int64_t[]> _buffer;
+
+    static void wait(size_t spins) {
+        if (spins < SpinLimit) {
+#if defined(__x86_64__) || defined(__i386__)
+            _mm_pause();
+#endif
+        } else {
+            std::this_thread::yield();
+        }
+    }
+};
+
+};
@@ -0,0 +1,187 @@
+#pragma once
+
+#include "io.h"
+#include "program.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace aoc19 {
+
+/*
+The state of a Computer part way through a run, written by Computer::save()
+and read back by Computer::load(), so that a long session can be carried on
+by another process instead of being run again from the start:
+
+    offset  size
+         0     8  magic "AOC19CP\0"
+         8     4  version (1)
+        12     4  flags, 1 if the VM pauses on output
+        16     8  program counter
+        24     8  relative base
+        32     8  hash of the program the VM was built from (Trace::hash())
+        40     8  words of dense memory, d
+        48     8  words of sparse memory, s
+        56     8  inputs queued, i
+        64     8  outputs the driver had not taken yet, o
+        72  8 * d dense memory from address 0
+           16 * s sparse memory, address then value
+            8 * i inputs
+            8 * o outputs
+
+Everything is int64 little endian, so on little endian machines read() maps
+the file and the memory is copied straight out of the page cache.
+*/
+class Checkpoint
+{
+public:
+    static constexpr char Magic[8] = { 'A', 'O', 'C', '1', '9', 'C', 'P', '\0' };
+    static constexpr uint32_t Version = 1;
+    static constexpr uint64_t HeaderSize = 72;
+
+    size_t pc = 0;
+    size_t relative_base = 0;
+    bool pause_on_output = false;
+    uint64_t program_hash = 0;
+    /// Dense memory, kept alive by the checkpoint when it was read
+    const int64_t* memory = nullptr;
+    size_t memory_size = 0;
+    /// Nonzero words of sparse memory, by address
+    std::vector<std::pair<size_t, int64_t>> sparse;
+    InputOutputs inputs;
+    InputOutputs outputs;
+
+    /// Write to path through a temporary file, so a checkpoint already
+    /// there is only replaced by a complete one
+    void write(const std::string& path) const {
+        const auto temporary = path + ".tmp";
+        {
+            std::ofstream f(temporary, std::ios::binary | std::ios::trunc);
+            f.write(Magic, sizeof(Magic));
+            write_le(f, Version, 4);
+            write_le(f, pause_on_output ? 1 : 0, 4);
+            write_le(f, pc, 8);
+            write_le(f, relative_base, 8);
+            write_le(f, program_hash, 8);
+            write_le(f, memory_size, 8);
+            write_le(f, sparse.size(), 8);
+            write_le(f, inputs.size(), 8);
+            write_le(f, outputs.size(), 8);
+            if (Program::is_little_endian()) {
+                f.write(reinterpret_cast<const char*>(memory), static_cast<std::streamsize>(8 * memory_size));
+            } else {
+                for (size_t i = 0; i < memory_size; i++) {
+                    write_le(f, static_cast<uint64_t>(memory[i]), 8);
+                }
+            }
+            for (const auto& w : sparse) {
+                write_le(f, w.first, 8);
+                write_le(f, static_cast<uint64_t>(w.second), 8);
+            }
+            for (auto queue : { inputs, outputs }) {
+                while (!queue.empty()) {
+                    write_le(f, static_cast<uint64_t>(queue.front()), 8);
+                    queue.pop();
+                }
+            }
+            if (!f.good()) {
+                throw std::runtime_error("Unable to write " + temporary);
+            }
+        }
+        if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+            throw std::runtime_error("Unable to replace " + path);
+        }
+    }
+
+    static Checkpoint read(const std::string& path) {
+        Checkpoint c;
+        const uint8_t* bytes = nullptr;
+        size_t length = 0;
+#if AOC_HAS_MMAP
+        if (Program::is_little_endian()) {
+            const int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                throw std::runtime_error("Unable to open " + path);
+            }
+            struct stat st;
+            length = ::fstat(fd, &st) == 0 ? static_cast<size_t>(st.st_size) : 0;
+            void* base = length ? ::mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+            ::close(fd);
+            if (base == MAP_FAILED) {
+                throw std::runtime_error("Unable to map " + path);
+            }
+            c._storage = std::shared_ptr<const void>(base, [length](const void* p) {
+                ::munmap(const_cast<void*>(p), length);
+            });
+            bytes = static_cast<const uint8_t*>(base);
+        }
+#endif
+        if (!bytes) {
+            std::ifstream f(path, std::ios::binary);
+            if (!f.good()) {
+                throw std::runtime_error("Unable to open " + path);
+            }
+            const auto buffer = std::make_shared<std::vector<uint8_t>>(
+                (std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+            bytes = buffer->data();
+            length = buffer->size();
+            c._storage = buffer;
+        }
+
+        if (length < HeaderSize || ::memcmp(bytes, Magic, sizeof(Magic)) != 0) {
+            throw std::runtime_error(path + " is not an IntCode checkpoint");
+        }
+        if (read_le(bytes + 8, 4) != Version) {
+            throw std::runtime_error(path + " is an unsupported IntCode checkpoint version");
+        }
+        c.pause_on_output = read_le(bytes + 12, 4) & 1;
+        c.pc = read_le(bytes + 16, 8);
+        c.relative_base = read_le(bytes + 24, 8);
+        c.program_hash = read_le(bytes + 32, 8);
+        c.memory_size = read_le(bytes + 40, 8);
+        const auto sparse = read_le(bytes + 48, 8);
+        const auto inputs = read_le(bytes + 56, 8);
+        const auto outputs = read_le(bytes + 64, 8);
+        const auto words = (length - HeaderSize) / 8;
+        if (c.memory_size > words || sparse > words || inputs > words || outputs > words ||
+                c.memory_size + 2 * sparse + inputs + outputs > words) {
+            throw std::runtime_error(path + " is truncated");
+        }
+
+        const uint8_t* p = bytes + HeaderSize;
+        if (Program::is_little_endian()) {
+            c.memory = reinterpret_cast<const int64_t*>(p);
+        } else {
+            auto memory = std::make_shared<Memory>(c.memory_size);
+            for (size_t i = 0; i < c.memory_size; i++) {
+                (*memory)[i] = static_cast<int64_t>(read_le(p + 8 * i, 8));
+            }
+            c.memory = memory->data();
+            c._storage = memory;
+        }
+        p += 8 * c.memory_size;
+
+        c.sparse.reserve(sparse);
+        for (size_t i = 0; i < sparse; i++, p += 16) {
+            c.sparse.emplace_back(read_le(p, 8), static_cast<int64_t>(read_le(p + 8, 8)));
+        }
+        for (size_t i = 0; i < inputs; i++, p += 8) {
+            c.inputs.push(static_cast<int64_t>(read_le(p, 8)));
+        }
+        for (size_t i = 0; i < outputs; i++, p += 8) {
+            c.outputs.push(static_cast<int64_t>(read_le(p, 8)));
+        }
+        return c;
+    }
+
+private:
+    /// Whatever memory points into, when it isn't the VM's own
+    std::shared_ptr<const void> _storage;
+};
+
+};
@@ -1,9 +1,24 @@
+#pragma once
+
 #include "helpers.h"
+#include "checkpoint.h"
+#include "io.h"
+#include "jit.h"
+#include "memo.h"
+#include "memory.h"
+#include "program.h"
+#include "channel.h"
+#include "profile.h"
+#include "trace.h"
+#include "zobrist.h"
 
+#include <array>
 #include <vector>
 #include <queue>
-#include <cmath>
+#include <algorithm>
+#include <cstring>
 #include <sstream>
+#include <type_traits>
 
 #ifdef AOC_DEBUG
 #define __DEBUG(x) do { \
@@ -15,17 +30,23 @@
 
 #define __DEBUG_PRINT(x) do { __DEBUG(std::cout << x << std::endl); } while (0)
 
+#ifdef AOC_PROFILE
+#define __PROFILE(x) do { \
+    x; \
+} while (0)
+#else
+#define __PROFILE(x)
+#endif
 
-namespace aoc19 {
 
-    using InputOutputs = std::queue<int64_t>;
-    using Memory = std::vector<int64_t>;
+namespace aoc19 {
 
     enum class HaltCode {
         HasOutput = 0,
         NeedsInput,
         Halt,
         Error,
+        BudgetExhausted,
     };
 /*
 ABCDE
@@ -72,6 +93,146 @@ private:
     std::string error;
 };
 
+/*
+Every legal instruction word, as X(opcode, mode1, mode2, mode3) with modes
+P(osition), I(mmediate) and R(elative). Parameters an opcode does not take
+are listed as P, which is the 0 digit. Output parameters are never I.
+*/
+#define __IC_W(X, op, m1, m2) X(op, m1, m2, P) X(op, m1, m2, R)
+#define __IC_RW(X, op, m1) __IC_W(X, op, m1, P) __IC_W(X, op, m1, I) __IC_W(X, op, m1, R)
+#define __IC_RRW(X, op) __IC_RW(X, op, P) __IC_RW(X, op, I) __IC_RW(X, op, R)
+#define __IC_R(X, op, m1) X(op, m1, P, P) X(op, m1, I, P) X(op, m1, R, P)
+#define __IC_RR(X, op) __IC_R(X, op, P) __IC_R(X, op, I) __IC_R(X, op, R)
+
+#define AOC19_INSTRUCTIONS(X) \
+    __IC_RRW(X, 1) \
+    __IC_RRW(X, 2) \
+    X(3, P, P, P) X(3, R, P, P) \
+    X(4, P, P, P) X(4, I, P, P) X(4, R, P, P) \
+    __IC_RR(X, 5) \
+    __IC_RR(X, 6) \
+    __IC_RRW(X, 7) \
+    __IC_RRW(X, 8) \
+    X(9, P, P, P) X(9, I, P, P) X(9, R, P, P) \
+    X(99, P, P, P)
+
+/*
+Superinstructions, pairs of instructions which run in one dispatch (see
+Computer::fuse()):
+
+  COMPARE_BRANCHES X(opcode, mode1, mode2, mode3, jump): SLT or SEQ, then a
+    JNZ or JZ on the flag it just wrote (the same address, or the same
+    relative offset) to an immediate target
+  FRAME_STORES X(opcode, mode1, mode2): ARB by an immediate, then an ADD or
+    MUL writing through relative mode
+  FRAME_JUMPS X(mode): ARB by an immediate, then an unconditional jump, the
+    return at the end of a function if the target is relative
+*/
+#define __IC_CB_J(X, op, m1, m2, m3) X(op, m1, m2, m3, 5) X(op, m1, m2, m3, 6)
+#define __IC_CB_W(X, op, m1, m2) __IC_CB_J(X, op, m1, m2, P) __IC_CB_J(X, op, m1, m2, R)
+#define __IC_CB_RW(X, op, m1) __IC_CB_W(X, op, m1, P) __IC_CB_W(X, op, m1, I) __IC_CB_W(X, op, m1, R)
+#define __IC_FS_R(X, op, m1) X(op, m1, P) X(op, m1, I) X(op, m1, R)
+
+#define AOC19_COMPARE_BRANCHES(X) \
+    __IC_CB_RW(X, 7, P) __IC_CB_RW(X, 7, I) __IC_CB_RW(X, 7, R) \
+    __IC_CB_RW(X, 8, P) __IC_CB_RW(X, 8, I) __IC_CB_RW(X, 8, R)
+
+#define AOC19_FRAME_STORES(X) \
+    __IC_FS_R(X, 1, P) __IC_FS_R(X, 1, I) __IC_FS_R(X, 1, R) \
+    __IC_FS_R(X, 2, P) __IC_FS_R(X, 2, I) __IC_FS_R(X, 2, R)
+
+#define AOC19_FRAME_JUMPS(X) X(P) X(I) X(R)
+
+#define __IC_DIGIT_P 0
+#define __IC_DIGIT_I 1
+#define __IC_DIGIT_R 2
+
+#define __IC_MODE_P ParameterMode::Position
+#define __IC_MODE_I ParameterMode::Immediate
+#define __IC_MODE_R ParameterMode::Relative
+
+#define __IC_NAME(op, m1, m2, m3) op_##op##_##m1##m2##m3
+#define __IC_CB_NAME(op, m1, m2, m3, jump) op_##op##_##m1##m2##m3##_##jump
+#define __IC_FS_NAME(op, m1, m2) op_9_I_##op##_##m1##m2##R
+#define __IC_FJ_NAME(mode) op_9_I_jump_##mode
+
+namespace detail {
+
+    /// Handler index for every decoded instruction
+    enum Handler : uint8_t {
+        InvalidOpcode = 0,
+        InvalidMode,
+#define __IC_ENUM(op, m1, m2, m3) __IC_NAME(op, m1, m2, m3),
+        AOC19_INSTRUCTIONS(__IC_ENUM)
+#undef __IC_ENUM
+#define __IC_CB_ENUM(op, m1, m2, m3, jump) __IC_CB_NAME(op, m1, m2, m3, jump),
+        AOC19_COMPARE_BRANCHES(__IC_CB_ENUM)
+#undef __IC_CB_ENUM
+#define __IC_FS_ENUM(op, m1, m2) __IC_FS_NAME(op, m1, m2),
+        AOC19_FRAME_STORES(__IC_FS_ENUM)
+#undef __IC_FS_ENUM
+#define __IC_FJ_ENUM(mode) __IC_FJ_NAME(mode),
+        AOC19_FRAME_JUMPS(__IC_FJ_ENUM)
+#undef __IC_FJ_ENUM
+        HandlerCount,
+    };
+
+    /// One past the largest legal instruction word (22208, SEQ with all relative)
+    constexpr int64_t HandlerTableSize = 22300;
+
+    /// Handler for each raw instruction word, built at compile time
+    constexpr auto make_handler_table() {
+        std::array<uint8_t, HandlerTableSize> table{};
+#define __IC_ENTRY(op, m1, m2, m3) \
+        table[op + 100 * __IC_DIGIT_##m1 + 1000 * __IC_DIGIT_##m2 + 10000 * __IC_DIGIT_##m3] = __IC_NAME(op, m1, m2, m3);
+        AOC19_INSTRUCTIONS(__IC_ENTRY)
+#undef __IC_ENTRY
+        return table;
+    }
+
+    constexpr auto HandlerTable = make_handler_table();
+
+    /// Superinstruction for a compare word followed by jump, or InvalidOpcode
+    constexpr uint8_t get_compare_branch(int64_t raw, int64_t jump) {
+#define __IC_CB_LOOKUP(op, m1, m2, m3, j) \
+        if (raw == op + 100 * __IC_DIGIT_##m1 + 1000 * __IC_DIGIT_##m2 + 10000 * __IC_DIGIT_##m3 && jump == j) { \
+            return __IC_CB_NAME(op, m1, m2, m3, j); \
+        }
+        AOC19_COMPARE_BRANCHES(__IC_CB_LOOKUP)
+#undef __IC_CB_LOOKUP
+        return InvalidOpcode;
+    }
+
+    /// Superinstruction for an immediate ARB followed by the ADD or MUL
+    /// word raw, or InvalidOpcode
+    constexpr uint8_t get_frame_store(int64_t raw) {
+#define __IC_FS_LOOKUP(op, m1, m2) \
+        if (raw == op + 100 * __IC_DIGIT_##m1 + 1000 * __IC_DIGIT_##m2 + 10000 * __IC_DIGIT_R) { \
+            return __IC_FS_NAME(op, m1, m2); \
+        }
+        AOC19_FRAME_STORES(__IC_FS_LOOKUP)
+#undef __IC_FS_LOOKUP
+        return InvalidOpcode;
+    }
+
+    /// Superinstruction for an immediate ARB followed by an unconditional
+    /// jump whose target has mode digit mode
+    constexpr uint8_t get_frame_jump(int64_t mode) {
+#define __IC_FJ_LOOKUP(m) \
+        if (mode == __IC_DIGIT_##m) { \
+            return __IC_FJ_NAME(m); \
+        }
+        AOC19_FRAME_JUMPS(__IC_FJ_LOOKUP)
+#undef __IC_FJ_LOOKUP
+        return InvalidOpcode;
+    }
+
+    static_assert(HandlerCount <= UINT8_MAX, "Handler index must fit in a byte");
+    static_assert(get_compare_branch(1207, 5) == op_7_RIP_5, "Compare and branch lookup out of sync");
+    static_assert(HandlerTable[22208] == op_8_RRR, "Handler table is keyed by the raw instruction word");
+
+};
+
 class  Computer
 {
     enum class ParameterMode {
@@ -80,6 +241,174 @@ class  Computer
         Relative
     };
 
+    /// An instruction word resolved to its mode-specialised handler, plus
+    /// its operand words. Decoded once per pc and cached until a store
+    /// touches one of its words. A superinstruction also holds the operand
+    /// words of the instruction it took in, and covers the words of both.
+    struct Instruction {
+        int64_t raw;
+        int64_t words[4];
+        uint8_t length; // 0 == not decoded
+        uint8_t handler; // detail::Handler
+        bool patched; // in DecodeCache::patched
+        uint8_t invalidations; // times a store dropped it, see MaxInvalidations
+    };
+
+    /// What a handler wants the engine to do next
+    enum class Step {
+        Next = 0,
+        Output,
+        NeedsInput,
+        Halt,
+    };
+
+    /// Decoded instructions for the program image, indexed by pc, and the
+    /// CodeMapBits for each word of it
+    struct DecodeCache {
+        std::vector<Instruction> instructions;
+        std::vector<uint8_t> code_map;
+        /// Addresses of instructions decoded from words which differ from
+        /// the program image, which initialize() has to drop
+        std::vector<size_t> patched;
+    };
+
+    /// Engine I/O through the input queue and an output queue
+    class QueueIo {
+    public:
+        static constexpr bool Inline = false;
+
+        InputOutputs& inputs;
+        InputOutputs& outputs;
+
+        bool read(int64_t& value) {
+            if (inputs.empty()) {
+                return false;
+            }
+            value = inputs.front(); inputs.pop();
+            return true;
+        }
+
+        bool write(int64_t value) {
+            outputs.push(value);
+            return true;
+        }
+    };
+
+    /// Engine I/O through channels, after anything left in the input queue
+    class ChannelIo {
+    public:
+        static constexpr bool Inline = false;
+
+        InputOutputs& inputs;
+        Channel& in;
+        Channel& out;
+
+        bool read(int64_t& value) {
+            if (!inputs.empty()) {
+                value = inputs.front(); inputs.pop();
+                return true;
+            }
+            return in.mode() == Channel::Mode::Blocking ? in.pop(value) : in.try_pop(value);
+        }
+
+        bool write(int64_t value) {
+            return out.mode() == Channel::Mode::Blocking ? out.push(value) : out.try_push(value);
+        }
+    };
+
+    /// Engine I/O through a source, after anything left in the input queue,
+    /// and a sink, see io.h
+    template <typename Source, typename Sink>
+    class PolicyIo {
+    public:
+        static constexpr bool Inline = Sink::Inline;
+
+        InputOutputs& inputs;
+        Source& source;
+        Sink& sink;
+
+        bool read(int64_t& value) {
+            if (!inputs.empty()) {
+                value = inputs.front(); inputs.pop();
+                return true;
+            }
+            return source.read(value);
+        }
+
+        bool write(int64_t value) {
+            return sink.write(value);
+        }
+    };
+
+    /// Engine instruction limit for plain runs, none. Limited engines run
+    /// every instruction on its own, only Compiled ones enter the JIT.
+    class Unbudgeted {
+    public:
+        static constexpr bool Limited = false;
+        static constexpr bool Compiled = true;
+
+        bool take() {
+            return true;
+        }
+    };
+
+    /// Engine instruction limit for budgeted runs, counts remaining down
+    class Budgeted {
+    public:
+        static constexpr bool Limited = true;
+        static constexpr bool Compiled = false;
+
+        uint64_t& remaining;
+
+        bool take() {
+            if (!remaining) {
+                return false;
+            }
+            remaining--;
+            return true;
+        }
+    };
+
+    /// No instruction limit, counts dispatches up, interpreter only
+    class Counted {
+    public:
+        static constexpr bool Limited = false;
+        static constexpr bool Compiled = false;
+
+        uint64_t& dispatches;
+
+        bool take() {
+            dispatches++;
+            return true;
+        }
+    };
+
+    /// No instruction limit, finishes and replays memoized calls before
+    /// each instruction, interpreter only
+    class Memoized {
+    public:
+        static constexpr bool Limited = false;
+        static constexpr bool Compiled = false;
+
+        Computer& computer;
+
+        bool take() {
+            computer.memo_dispatch();
+            return true;
+        }
+    };
+
+    /// Longest instruction (opcode + 3 parameters)
+    static constexpr size_t MaxInstructionLength = 4;
+
+    /// Longest superinstruction, a compare and a jump
+    static constexpr size_t MaxFusedLength = 7;
+
+    /// Instructions whose words keep being overwritten (like Day2's, which
+    /// store over their own operands) are decoded afresh each time instead
+    /// of being cached only to be dropped again
+    static constexpr uint8_t MaxInvalidations = 2;
+
 public:
     Computer(const std::string& program)
         : Computer(program, false)
@@ -87,31 +416,176 @@ public:
     }
 
     Computer(const std::string& program, bool pause_on_output)
+        : Computer(Program::load(program), pause_on_output)
+    {
+    }
+
+    Computer(const Program& program)
+        : Computer(program, false)
+    {
+    }
+
+    Computer(const Program& program, bool pause_on_output)
         : _last_op(0)
         , _pc(SIZE_MAX)
         , _relative_base(0)
-        , _pause_on_output(pause_on_output) {
-        aoc::parse_as_integers(program, ',', [&](const auto t) { _init.push_back(t); });
+        , _pause_on_output(pause_on_output)
+        , _memory(std::make_shared<Memory>())
+        , _init(program)
+        , _decoded(std::make_shared<DecodeCache>()) {
         __DEBUG_PRINT("Memory Size: " << _init.size());
+        __PROFILE(_profile.set_program_size(_init.size()));
+        if (Memo::enabled_by_default()) {
+            set_memoize(true);
+        }
+    }
+
+    /// A copy of this VM (memory, pc, relative base and queued input) which
+    /// shares memory and decoded instructions with it, so forking is a few
+    /// pointer copies. Either one storing to shared memory copies just the
+    /// page written, and decoding an instruction the cache doesn't have yet
+    /// copies the cache. Compiled code is not shared, the fork starts with
+    /// an empty JIT.
+    /// The fork isn't traced, it would garble this VM's trace.
+    Computer fork() const {
+        Computer copy(*this);
+        copy.set_trace(nullptr);
+        return copy;
+    }
+
+    /// Write memory, program counter, relative base, queued input and
+    /// whether it pauses on output to path, see Checkpoint, along with
+    /// outputs the driver hasn't taken yet
+    void save(const std::string& path, const InputOutputs& outputs = {}) const {
+        Checkpoint c;
+        c.pc = _pc;
+        c.relative_base = _relative_base;
+        c.pause_on_output = _pause_on_output;
+        c.program_hash = Trace::hash(_init);
+        const auto memory = dense_memory();
+        c.memory = memory->data();
+        c.memory_size = memory->size();
+        _sparse.for_each([&](size_t address, int64_t value) { c.sparse.emplace_back(address, value); });
+        std::sort(c.sparse.begin(), c.sparse.end());
+        c.inputs = _inputs;
+        c.outputs = outputs;
+        c.write(path);
+    }
+
+    /// Carry on from a checkpoint written by save() from a VM running the
+    /// same program, in place of whatever this VM was doing. The outputs it
+    /// had are added to outputs. The VM stops being traced, a trace can't
+    /// be replayed across a load().
+    void load(const std::string& path, InputOutputs& outputs) {
+        const auto c = Checkpoint::read(path);
+        if (c.program_hash != Trace::hash(_init)) {
+            throw std::runtime_error(path + " is a checkpoint of a different program");
+        }
+
+        // Compiled code survives if its words are the same in the checkpoint
+        // as in the program, which initialize() then checks against memory
+        const auto memory = c.memory;
+        const auto& init = _init;
+        _jit.retain([&](size_t start, size_t end) {
+            return end <= c.memory_size && end <= init.size() &&
+                std::equal(memory + start, memory + end, init.begin() + start);
+        });
+        set_trace(nullptr);
+        initialize();
+        writable_memory().assign(memory, memory + c.memory_size);
+        _direct = _memory->size();
+        for (const auto& w : c.sparse) {
+            _sparse.set(w.first, w.second);
+        }
+        // Memory was replaced behind store()'s back
+        forget_changed();
+        for (const auto a : _memo.code()) {
+            if (get(a) != init[a]) {
+                _memo.flush();
+                break;
+            }
+        }
+        if (_zobrist.enabled()) {
+            _zobrist.reset(*_memory, _sparse);
+        }
+        _inputs = c.inputs;
+        for (auto o = c.outputs; !o.empty(); o.pop()) {
+            outputs.push(o.front());
+        }
+        _pc = c.pc;
+        _relative_base = c.relative_base;
+        _pause_on_output = c.pause_on_output;
+    }
+
+    void load(const std::string& path) {
+        InputOutputs outputs;
+        load(path, outputs);
     }
 
     void initialize(int64_t noun, int64_t verb) {
         initialize();
 
-        store(1, noun);
-        store(2, verb);
+        set_memory(1, noun);
+        set_memory(2, verb);
     }
 
     void initialize() {
-        _memory = _init;
+        // Compiled code and decoded instructions survive a reload if the
+        // words they came from did
+        const auto& init = _init;
+        {
+            const auto memory = dense_memory();
+            _jit.retain([&](size_t start, size_t end) {
+                return end <= memory->size() && end <= init.size() &&
+                    std::equal(init.begin() + start, init.begin() + end, memory->begin() + start);
+            });
+        }
+        _pages.clear();
+
+        // Reuse the buffers unless a fork still has them
+        if (_memory.use_count() > 1) {
+            _memory = std::make_shared<Memory>(init.begin(), init.end());
+        } else {
+            _memory->assign(init.begin(), init.end());
+        }
+        _direct = _memory->size();
+        _sparse.clear();
+        // A store to a decoded word drops the instruction, so the others
+        // still match memory and only the patched ones can differ from init
+        auto& cache = writable_decoded();
+        if (cache.instructions.size() != init.size()) {
+            cache.instructions.assign(init.size(), Instruction{});
+            cache.code_map.assign(init.size() + MaxFusedLength - 1, 0);
+            cache.patched.clear();
+        }
+        forget_patched(cache);
+        _jit.mark(cache.code_map.data());
+        const auto translated = std::min(_translated_size, cache.code_map.size());
+        for (size_t p = 0; p < translated; p++) {
+            if (_translated[p]) {
+                cache.code_map[p] |= CodeMapBits::Translated;
+            }
+        }
+        mark_memoized(cache.code_map);
+        _translated_written = false;
         _pc = 0;
         _relative_base = 0;
         while (!_inputs.empty()) {
             _inputs.pop();
         }
+        if (_trace) {
+            _trace->reset();
+        }
+        _memo.abandon();
+        if (_zobrist.enabled()) {
+            _zobrist.reset(*_memory, _sparse);
+        }
     }
 
     void set_memory(size_t address, int64_t value) {
+        if (_trace) {
+            _trace->patch(address, value);
+        }
         store(address, value);
     }
 
@@ -123,135 +597,159 @@ public:
         _pause_on_output = !v;
     }
 
+    /// Compile hot blocks to native code (also enabled by AOC_JIT=1)
+    void set_jit(bool v) {
+        _jit.set_enabled(v);
+    }
+
+    bool jit_enabled() const {
+        return _jit.enabled();
+    }
+
+    /// Run common pairs of instructions as one superinstruction (on by
+    /// default, except in profiling builds which count every instruction)
+    void set_fusion(bool v) {
+#if defined(AOC_PROFILE)
+        v = false;
+#endif
+        if (v == _fuse) {
+            return;
+        }
+        _fuse = v;
+        for (auto& insn : writable_decoded().instructions) {
+            insn.length = 0;
+        }
+    }
+
+    bool fusion_enabled() const {
+        return _fuse;
+    }
+
+    /// Skip calls of pure subroutines made before with the same arguments,
+    /// see Memo (also enabled by AOC_MEMO=1). Only run() memoizes, and it
+    /// keeps the VM out of compiled code.
+    void set_memoize(bool v) {
+        _memo.set_enabled(v, _init);
+        if (initialized()) {
+            auto& code_map = writable_decoded().code_map;
+            for (auto& bits : code_map) {
+                bits &= static_cast<uint8_t>(~CodeMapBits::Memoized);
+            }
+            mark_memoized(code_map);
+        }
+    }
+
+    const Memo& memo() const {
+        return _memo;
+    }
+
+    /// Keep a hash of memory up to date on every store, so state_hash()
+    /// is O(1), see ZobristHash. It keeps the VM out of compiled code,
+    /// which writes memory behind store()'s back.
+    void set_state_hash(bool v) {
+        if (v && !_zobrist.enabled()) {
+            _zobrist.reset(*dense_memory(), _sparse);
+        }
+        _zobrist.set_enabled(v);
+    }
+
+    bool state_hash_enabled() const {
+        return _zobrist.enabled();
+    }
+
+    /// Hash of memory, program counter and relative base: equal for equal
+    /// VM states, whatever path led to them. Hashes all of memory unless
+    /// set_state_hash() is on.
+    uint64_t state_hash() const {
+        const auto memory = _zobrist.enabled() ? _zobrist.memory() : ZobristHash::of(*dense_memory(), _sparse);
+        return ZobristHash::combine(memory, _pc, _relative_base);
+    }
+
+    /// Record what this VM does to trace, or stop recording with nullptr.
+    /// A trace with branches keeps the VM out of compiled code.
+    void set_trace(std::shared_ptr<TraceRecorder> trace) {
+        _trace = std::move(trace);
+        _trace_branches = _trace && _trace->branches();
+    }
+
+    const std::shared_ptr<TraceRecorder>& trace() const {
+        return _trace;
+    }
+
     HaltCode run(const InputOutputs& inputs, InputOutputs& outputs) {
         _inputs = inputs;
         return run(outputs);
     }
 
     HaltCode run(InputOutputs& outputs) {
-        if (!initialized()) {
-            initialize();
-        }
+        QueueIo io{ _inputs, outputs };
+        return run(io);
+    }
 
-        while (true) {
-            _last_op = get_address(0);
+    /// Run for at most budget instructions, taking the number dispatched off
+    /// budget. BudgetExhausted means it ran out first, run again to carry on.
+    /// Compiled code can't be counted, so budgeted runs stay in the
+    /// interpreter.
+    HaltCode run(InputOutputs& outputs, uint64_t& budget) {
+        QueueIo io{ _inputs, outputs };
+#if defined(AOC_THREADED_DISPATCH)
+        return run_threaded(io, Budgeted{ budget });
+#else
+        return run_switch(io, Budgeted{ budget });
+#endif
+    }
 
-            const auto opcode = get_opcode();
+    /// Run like run(outputs), adding the number of dispatches (instructions,
+    /// with superinstructions counting once) to dispatches. Always
+    /// interpreted.
+    HaltCode run_counted(InputOutputs& outputs, uint64_t& dispatches) {
+        QueueIo io{ _inputs, outputs };
+#if defined(AOC_THREADED_DISPATCH)
+        return run_threaded(io, Counted{ dispatches });
+#else
+        return run_switch(io, Counted{ dispatches });
+#endif
+    }
 
-            __DEBUG_PRINT("PC: " << _pc << " RB: " << _relative_base << " OP: " << _last_op);
+    /// Run reading input from in, once anything queued with set_input() is
+    /// used up, and writing output to out. Each channel's mode says whether
+    /// to wait on it. Without waiting, NeedsInput means in was empty and
+    /// HasOutput with nothing written means out was full; either way run
+    /// again to carry on. Closing in turns a wait for input into NeedsInput.
+    HaltCode run(Channel& in, Channel& out) {
+        ChannelIo io{ _inputs, in, out };
+        return run(io);
+    }
 
-            switch (opcode) {
-                case 1: // add
-                {
-                    const auto d1 = get_parameter(1);
-                    const auto d2 = get_parameter(2);
-                    const auto d3 = get_output_address(3);
-                    __DEBUG_PRINT("ADD: " << d1 << "," << d2 << " -> " << d3);
-                    store(d3, d1 + d2);
-                    _pc += 4;
-                    break;
-                }
-                case 2: // multiply
-                {
-                    const auto d1 = get_parameter(1);
-                    const auto d2 = get_parameter(2);
-                    const auto d3 = get_output_address(3);
-                    __DEBUG_PRINT("MUL: " << d1 << "," << d2 << " -> " << d3);
-                    store(d3, d1 * d2);
-                    _pc += 4;
-                    break;
-                }
-                case 3: // input
-                {
-                    assert(!_inputs.empty());
-                    if (_inputs.empty()) {
-                        return HaltCode::NeedsInput;
-                    }
-
-                    const auto value = _inputs.front(); _inputs.pop();
-                    const auto address = get_output_address(1);
-                    __DEBUG_PRINT("IN: " << value << " -> " << address);
-                    store(address, value);
-                    _pc += 2;
-                    break;
-                }
-                case 4: // output
-                {
-                    const auto value = get_parameter(1);
-                    __DEBUG_PRINT("OUT: " << value);
-                    outputs.push(value);
-                    _pc += 2;
-                    if (_pause_on_output) {
-                        return HaltCode::HasOutput;
-                    }
-                    break;
-                }
-                case 5: // Jump if true
-                {
-                    const auto value = get_parameter(1);
-                    const auto new_pc = get_parameter(2);
-                    __DEBUG_PRINT("JNZ: " << value << "," << new_pc);
-                    if (value) {
-                        _pc = new_pc;
-                    } else {
-                        _pc += 3;
-                    }
-                    break;
-                }
-                case 6: // Jump if false
-                {
-                    const auto value = get_parameter(1);
-                    const auto new_pc = get_parameter(2);
-                    __DEBUG_PRINT("JZ: " << value << "," << new_pc);
-                    if (!value) {
-                        _pc = new_pc;
-                    } else {
-                        _pc += 3;
-                    }
-                    break;
-                }
-                case 7: // Less than
-                {
-                    const auto d1 = get_parameter(1);
-                    const auto d2 = get_parameter(2);
-                    const auto d3 = get_output_address(3);
-                    __DEBUG_PRINT("SLT: " << d1 << "," << d2 << " -> " << d3);
-                    store(d3, d1 < d2);
-                    _pc += 4;
-                    break;
-                    
-                }
-                case 8: // Equal
-                {
-                    const auto d1 = get_parameter(1);
-                    const auto d2 = get_parameter(2);
-                    const auto d3 = get_output_address(3);
-                    __DEBUG_PRINT("SEQ: " << d1 << "," << d2 << " -> " << d3);
-                    store(d3, d1 == d2);
-                    _pc += 4;
-                    break;
-                }
-                case 9: // Adjust relative base
-                {
-                    const auto d1 = get_parameter(1);
-                    __DEBUG_PRINT("ARB: " << d1);
-                    _relative_base += d1;
-                    _pc += 2;
-                    break;
-                }
-                case 99: // halt
-                    return HaltCode::Halt;
-                default: // invalid opcode
-                   throw InvalidOpcode(_pc, opcode);
-            }
-        }
-        throw InvalidOpcode(_pc, _last_op);
+    /// Run reading input from source, once anything queued with set_input()
+    /// is used up, and writing output to sink, without coming back here for
+    /// each value when the sink is Inline. See io.h for the policies.
+    template <typename Source, typename Sink>
+    HaltCode run_with(Source&& source, Sink&& sink) {
+        PolicyIo<std::remove_reference_t<Source>, std::remove_reference_t<Sink>> io{ _inputs, source, sink };
+        return run(io);
+    }
+
+    /// Portable engine, one switch over the handler index shared by every
+    /// instruction
+    HaltCode run_switch(InputOutputs& outputs) {
+        QueueIo io{ _inputs, outputs };
+        return run_switch(io);
     }
 
+#if defined(__GNUC__)
+    /// Direct-threaded engine, every handler ends in its own indirect jump
+    /// to the next handler (labels-as-values, GCC and Clang only)
+    HaltCode run_threaded(InputOutputs& outputs) {
+        QueueIo io{ _inputs, outputs };
+        return run_threaded(io);
+    }
+#endif
+
     friend std::ostream& operator<<(std::ostream& os, const Computer& comp) {
         bool first = true;
         size_t p = 0;
-        const auto& mem = comp._memory.empty() ? comp._init : comp._memory;
+        const auto mem = comp._memory->empty() ? Memory(comp._init.begin(), comp._init.end()) : *comp.dense_memory();
         for (const auto c : mem) {
             if (!first) {
                 os << ",";
@@ -276,92 +774,864 @@ public:
     }
 
     int64_t get(size_t address) const {
-        if (address >= _memory.size()) {
-            return 0;
+        if (address < _direct) {
+            return (*_memory)[address];
         }
-        return _memory[address];
+        if (address >= _memory->size()) {
+            return _sparse.get(address);
+        }
+        const auto& page = _pages[address / PagedMemory::PageWords];
+        return page ? (*page)[address % PagedMemory::PageWords] : (*_memory)[address];
     }
 
     bool initialized() const {
         return _pc != SIZE_MAX;
     }
 
+    const Program& program() const {
+        return _init;
+    }
+
+#if defined(AOC_PROFILE)
+    /// Counts of everything run since construction or clear_profile(),
+    /// including instructions per recovered function (Profile::calls()). A
+    /// profiling build never enters compiled code, so that nothing is missed.
+    const Profile& profile() const {
+        return _profile;
+    }
+
+    void clear_profile() {
+        _profile.clear();
+    }
+#endif
+
 protected:
     int64_t _last_op;
     size_t _pc;
     size_t _relative_base;
     bool _pause_on_output;
 
-    Memory _memory;
-    Memory _init;
+    /// Dense memory from address 0, anything written beyond it which is too
+    /// far away to be worth growing it for goes in _sparse. Both are shared
+    /// copy-on-write with forks, as is everything else behind a shared_ptr.
+    std::shared_ptr<Memory> _memory;
+    /// Pages of _memory written while a fork still shared it, by page
+    /// number, null where _memory is still right. Empty if there are none.
+    std::vector<std::shared_ptr<PagedMemory::Page>> _pages;
+    /// Words get() can read straight from _memory, none while there are
+    /// _pages
+    size_t _direct = 0;
+    PagedMemory _sparse;
+    Program _init;
     InputOutputs _inputs;
 
+    std::shared_ptr<DecodeCache> _decoded;
+    Instruction _scratch;
+    Jit _jit;
+    std::shared_ptr<TraceRecorder> _trace;
+    bool _trace_branches = false;
+    Memo _memo;
+    ZobristHash _zobrist;
+    /// Words of instructions translated ahead of time (see AotComputer),
+    /// and whether any of them has been written since initialize()
+    const uint8_t* _translated = nullptr;
+    size_t _translated_size = 0;
+    bool _translated_written = false;
+#if defined(AOC_PROFILE)
+    bool _fuse = false;
+#else
+    bool _fuse = true;
+#endif
+#if defined(AOC_PROFILE)
+    Profile _profile;
+#endif
+
+    void store(size_t address, int64_t val) {
+        __PROFILE(_profile.stored(val));
+        if (_memo.recording()) {
+            _memo.stored(address, val);
+        }
+        if (_zobrist.enabled()) {
+            _zobrist.stored(address, get(address), val);
+        }
+        if (address < _direct && _memory.use_count() == 1) {
+            (*_memory)[address] = val;
+        } else if (!store_elsewhere(address, val)) {
+            return;
+        }
+        const auto& code_map = _decoded->code_map;
+        if (address < code_map.size() && code_map[address]) {
+            invalidate(address);
+        }
+    }
+
 private:
 
-    /// Opcode is a two-digit decimal number
-    int64_t get_opcode() {
-        return get(_pc) % 100;
+    template <typename Io>
+    HaltCode run(Io& io) {
+#if defined(AOC_THREADED_DISPATCH)
+        if (_memo.enabled()) {
+            return run_threaded(io, Memoized{ *this });
+        }
+        return run_threaded(io);
+#else
+        if (_memo.enabled()) {
+            return run_switch(io, Memoized{ *this });
+        }
+        return run_switch(io);
+#endif
     }
 
-    /// Return the parameter mode for the parameter with the given index
-    ParameterMode get_parameter_mode(int index) {
-        const int mode = (get(_pc) / static_cast<int64_t>(std::pow(10, index + 1))) % 10;
-        switch (mode) {
-            case 0:
-                return ParameterMode::Position;
-            case 1:
-                return ParameterMode::Immediate;
-            case 2:
-                return ParameterMode::Relative;
+    /// Finish the recordings of calls returning to the program counter, and
+    /// replay calls already recorded until it isn't at one
+    void memo_dispatch() {
+        while (true) {
+            if (_memo.recording()) {
+                _memo.returned(_pc, _relative_base);
+            }
+            if (!_memo.is_entry(_pc)) {
+                return;
+            }
+            const auto writes = _memo.enter(_pc, _relative_base, [this](size_t address) { return get(address); });
+            if (!writes) {
+                return;
+            }
+            for (const auto& w : *writes) {
+                store(w.absolute ? w.address : _relative_base + w.address, w.value);
+            }
+            _pc = get(_relative_base);
         }
-        throw std::runtime_error("Invalid parameter mode");
     }
 
-    void store(size_t address, int64_t val) {
-        if (address >= _memory.size()) {
-            _memory.resize(address + 1, 0);
+    template <typename Io, typename Budget = Unbudgeted>
+    HaltCode run_switch(Io& io, Budget budget = {}) {
+        if (!initialized()) {
+            initialize();
         }
-        _memory[address] = val;
+
+        while (true) {
+            if (!budget.take()) {
+                return HaltCode::BudgetExhausted;
+            }
+
+            const auto& insn = fetch();
+            _last_op = insn.raw;
+
+            __DEBUG_PRINT("PC: " << _pc << " RB: " << _relative_base << " OP: " << _last_op);
+            __PROFILE(_profile.instruction(_pc, insn.raw));
+
+            Step step;
+            switch (insn.handler) {
+#define __IC_CASE(op, m1, m2, m3) \
+                case detail::__IC_NAME(op, m1, m2, m3): \
+                    step = execute<op, __IC_MODE_##m1, __IC_MODE_##m2, __IC_MODE_##m3, Budget>(insn, io); \
+                    break;
+                AOC19_INSTRUCTIONS(__IC_CASE)
+#undef __IC_CASE
+#define __IC_CB_CASE(op, m1, m2, m3, jump) \
+                case detail::__IC_CB_NAME(op, m1, m2, m3, jump): \
+                    step = execute_compare_branch<op, __IC_MODE_##m1, __IC_MODE_##m2, __IC_MODE_##m3, jump, Budget>(insn, io); \
+                    break;
+                AOC19_COMPARE_BRANCHES(__IC_CB_CASE)
+#undef __IC_CB_CASE
+#define __IC_FS_CASE(op, m1, m2) \
+                case detail::__IC_FS_NAME(op, m1, m2): \
+                    step = execute_frame_store<op, __IC_MODE_##m1, __IC_MODE_##m2, Budget>(insn, io); \
+                    break;
+                AOC19_FRAME_STORES(__IC_FS_CASE)
+#undef __IC_FS_CASE
+#define __IC_FJ_CASE(mode) \
+                case detail::__IC_FJ_NAME(mode): \
+                    step = execute_frame_jump<__IC_MODE_##mode, Budget>(insn, io); \
+                    break;
+                AOC19_FRAME_JUMPS(__IC_FJ_CASE)
+#undef __IC_FJ_CASE
+                case detail::InvalidMode:
+                    throw_invalid_mode(insn);
+                default: // invalid opcode
+                    throw InvalidOpcode(_pc, insn.raw % 100);
+            }
+
+            if (step != Step::Next) {
+                return get_halt_code(step);
+            }
+        }
+        throw InvalidOpcode(_pc, _last_op);
     }
 
-    /// Dereference memory at index based on the program counter
-    int64_t get_address(int index) {
-        return get_relative_address(_pc, index);
+#if defined(__GNUC__)
+    template <typename Io, typename Budget = Unbudgeted>
+    HaltCode run_threaded(Io& io, Budget budget = {}) {
+        if (!initialized()) {
+            initialize();
+        }
+
+        static const void* const handlers[] = {
+            &&op_invalid_opcode,
+            &&op_invalid_mode,
+#define __IC_LABEL_ADDRESS(op, m1, m2, m3) &&__IC_NAME(op, m1, m2, m3),
+            AOC19_INSTRUCTIONS(__IC_LABEL_ADDRESS)
+#undef __IC_LABEL_ADDRESS
+#define __IC_CB_LABEL_ADDRESS(op, m1, m2, m3, jump) &&__IC_CB_NAME(op, m1, m2, m3, jump),
+            AOC19_COMPARE_BRANCHES(__IC_CB_LABEL_ADDRESS)
+#undef __IC_CB_LABEL_ADDRESS
+#define __IC_FS_LABEL_ADDRESS(op, m1, m2) &&__IC_FS_NAME(op, m1, m2),
+            AOC19_FRAME_STORES(__IC_FS_LABEL_ADDRESS)
+#undef __IC_FS_LABEL_ADDRESS
+#define __IC_FJ_LABEL_ADDRESS(mode) &&__IC_FJ_NAME(mode),
+            AOC19_FRAME_JUMPS(__IC_FJ_LABEL_ADDRESS)
+#undef __IC_FJ_LABEL_ADDRESS
+        };
+        static_assert(sizeof(handlers) / sizeof(handlers[0]) == detail::HandlerCount, "Handler labels out of sync");
+
+        const Instruction* insn;
+
+#define __DISPATCH() do { \
+    if (!budget.take()) { \
+        return HaltCode::BudgetExhausted; \
+    } \
+    insn = &fetch(); \
+    _last_op = insn->raw; \
+    __DEBUG_PRINT("PC: " << _pc << " RB: " << _relative_base << " OP: " << _last_op); \
+    __PROFILE(_profile.instruction(_pc, insn->raw)); \
+    goto *handlers[insn->handler]; \
+} while (0)
+
+        __DISPATCH();
+
+#define __IC_LABEL(op, m1, m2, m3) \
+    __IC_NAME(op, m1, m2, m3): \
+        { \
+            const auto step = execute<op, __IC_MODE_##m1, __IC_MODE_##m2, __IC_MODE_##m3, Budget>(*insn, io); \
+            if (step != Step::Next) { \
+                return get_halt_code(step); \
+            } \
+            __DISPATCH(); \
+        }
+        AOC19_INSTRUCTIONS(__IC_LABEL)
+#undef __IC_LABEL
+
+#define __IC_FUSED_LABEL(name, call) \
+    name: \
+        { \
+            const auto step = call; \
+            if (step != Step::Next) { \
+                return get_halt_code(step); \
+            } \
+            __DISPATCH(); \
+        }
+#define __IC_CB_LABEL(op, m1, m2, m3, jump) \
+        __IC_FUSED_LABEL(__IC_CB_NAME(op, m1, m2, m3, jump), \
+            (execute_compare_branch<op, __IC_MODE_##m1, __IC_MODE_##m2, __IC_MODE_##m3, jump, Budget>(*insn, io)))
+        AOC19_COMPARE_BRANCHES(__IC_CB_LABEL)
+#undef __IC_CB_LABEL
+#define __IC_FS_LABEL(op, m1, m2) \
+        __IC_FUSED_LABEL(__IC_FS_NAME(op, m1, m2), (execute_frame_store<op, __IC_MODE_##m1, __IC_MODE_##m2, Budget>(*insn, io)))
+        AOC19_FRAME_STORES(__IC_FS_LABEL)
+#undef __IC_FS_LABEL
+#define __IC_FJ_LABEL(mode) \
+        __IC_FUSED_LABEL(__IC_FJ_NAME(mode), (execute_frame_jump<__IC_MODE_##mode, Budget>(*insn, io)))
+        AOC19_FRAME_JUMPS(__IC_FJ_LABEL)
+#undef __IC_FJ_LABEL
+#undef __IC_FUSED_LABEL
+
+    op_invalid_mode:
+        throw_invalid_mode(*insn);
+    op_invalid_opcode:
+        throw InvalidOpcode(_pc, insn->raw % 100);
+
+#undef __DISPATCH
     }
+#endif
+
+    /// Gap past the end of _memory which is still filled in, rather than paged
+    static constexpr size_t DenseSlack = 64 * 1024;
 
-    int64_t get_relative_address(size_t base, size_t offset) {
-        return get(base + offset);
+    bool is_dense(size_t address) const {
+        return address < _memory->size() + DenseSlack || address / 2 < _memory->size();
     }
 
-    /// Get the parameter value at index based on the program counter
-    int64_t get_parameter(int index) {
+    /// Extend _memory to size words, taking over anything paged in that range
+    void grow(size_t size) {
+        auto& memory = writable_memory();
+        const auto old = memory.size();
+        memory.resize(size, 0);
+        _direct = size;
+        if (!_sparse.empty()) {
+            _sparse.drain(old, size, memory.data() + old);
+        }
+    }
 
-        const auto val = get_address(index);
+    /// store() to memory a fork shares, to _pages, or past the end of
+    /// _memory, false if it went in _sparse
+    bool store_elsewhere(size_t address, int64_t val) {
+        if (address >= _memory->size()) {
+            if (!is_dense(address)) {
+                _sparse.set(address, val);
+                return false;
+            }
+            grow(address + 1);
+        }
+        if (_memory.use_count() > 1) {
+            writable_page(address)[address % PagedMemory::PageWords] = val;
+        } else {
+            writable_memory()[address] = val;
+        }
+        return true;
+    }
 
-        switch (get_parameter_mode(index)) {
-            case ParameterMode::Immediate:
-                return val;
-            case ParameterMode::Position:
-                return get_relative_address(0, val);
-            case ParameterMode::Relative:
-                return get_relative_address(_relative_base, val);
+    /// Dense memory in one piece, copied first if a fork still shares it
+    Memory& writable_memory() {
+        if (_memory.use_count() > 1) {
+            _memory = std::make_shared<Memory>(*_memory);
         }
-        throw std::runtime_error("Invalid parameter mode");
+        if (!_pages.empty()) {
+            apply_pages(*_memory);
+            _pages.clear();
+            _direct = _memory->size();
+        }
+        return *_memory;
+    }
+
+    /// The page of dense memory holding address, copied out of _memory (or
+    /// a page a fork still shares) first, so that a store to memory a fork
+    /// shares copies one page rather than all of it
+    PagedMemory::Page& writable_page(size_t address) {
+        if (_pages.empty()) {
+            _pages.resize((_memory->size() + PagedMemory::PageWords - 1) / PagedMemory::PageWords);
+            _direct = 0;
+        }
+        auto& page = _pages[address / PagedMemory::PageWords];
+        if (!page) {
+            page = std::make_shared<PagedMemory::Page>();
+            const auto first = address - address % PagedMemory::PageWords;
+            const auto last = std::min(first + PagedMemory::PageWords, _memory->size());
+            std::copy(_memory->begin() + first, _memory->begin() + last, page->begin());
+        } else if (page.use_count() > 1) {
+            page = std::make_shared<PagedMemory::Page>(*page);
+        }
+        return *page;
+    }
+
+    /// Write the pages over memory, which is as long as _memory
+    void apply_pages(Memory& memory) const {
+        for (size_t n = 0; n < _pages.size(); n++) {
+            if (_pages[n]) {
+                const auto first = n * PagedMemory::PageWords;
+                const auto words = std::min(PagedMemory::PageWords, memory.size() - first);
+                std::copy_n(_pages[n]->begin(), words, memory.begin() + first);
+            }
+        }
+    }
+
+    /// Dense memory in one piece, a copy if any of it is in _pages
+    std::shared_ptr<const Memory> dense_memory() const {
+        if (_pages.empty()) {
+            return _memory;
+        }
+        auto memory = std::make_shared<Memory>(*_memory);
+        apply_pages(*memory);
+        return memory;
+    }
+
+    /// Drop the cached instructions with a word at address
+    static void forget_decoded(DecodeCache& cache, size_t address) {
+        const size_t first = address >= MaxFusedLength - 1 ? address - (MaxFusedLength - 1) : 0;
+        const size_t last = std::min(address + 1, cache.instructions.size());
+        for (size_t p = first; p < last; p++) {
+            auto& insn = cache.instructions[p];
+            if (insn.length > address - p) {
+                insn.length = 0;
+                if (insn.invalidations < MaxInvalidations) {
+                    insn.invalidations++;
+                }
+            }
+        }
+    }
+
+    /// Drop the cached instructions decoded from words which differed from
+    /// the image
+    static void forget_patched(DecodeCache& cache) {
+        for (const auto p : cache.patched) {
+            cache.instructions[p].length = 0;
+            cache.instructions[p].patched = false;
+        }
+        cache.patched.clear();
+    }
+
+    /// Whether any of the length words at address differ from the image
+    bool is_patched(size_t address, size_t length) const {
+        for (size_t a = address; a < address + length; a++) {
+            if (get(a) != (a < _init.size() ? _init[a] : 0)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /// Drop the cached instructions with a word memory no longer has the
+    /// same as the image, for when memory was replaced without store()
+    void forget_changed() {
+        auto& cache = writable_decoded();
+        forget_patched(cache);
+        const auto forget = [&cache](size_t address) {
+            if (cache.code_map[address] & CodeMapBits::Decoded) {
+                forget_decoded(cache, address);
+                cache.code_map[address] &= static_cast<uint8_t>(~CodeMapBits::Decoded);
+            }
+        };
+
+        const auto memory = dense_memory();
+        const auto words = std::min(memory->size(), _init.size());
+        const int64_t* now = memory->data();
+        const int64_t* was = _init.data();
+        // Mostly the same, so skip along in blocks memcmp() can compare
+        constexpr size_t Block = 64;
+        for (size_t start = 0; start < words; start += Block) {
+            const auto end = std::min(start + Block, words);
+            if (::memcmp(now + start, was + start, (end - start) * sizeof(int64_t)) == 0) {
+                continue;
+            }
+            for (size_t a = start; a < end; a++) {
+                if (now[a] != was[a]) {
+                    forget(a);
+                }
+            }
+        }
+        for (size_t a = words; a < cache.code_map.size(); a++) {
+            if (get(a) != (a < _init.size() ? _init[a] : 0)) {
+                forget(a);
+            }
+        }
+    }
+
+    /// Flag memoized functions' code, so that any store to it, decoded or
+    /// not, reaches invalidate() and drops what Memo kept
+    void mark_memoized(std::vector<uint8_t>& code_map) const {
+        for (const auto a : _memo.code()) {
+            code_map[a] |= CodeMapBits::Memoized;
+        }
+    }
+
+    DecodeCache& writable_decoded() {
+        if (_decoded.use_count() > 1) {
+            _decoded = std::make_shared<DecodeCache>(*_decoded);
+        }
+        return *_decoded;
+    }
+
+    /// Whether parameter index of opcode is written to
+    static bool is_output_parameter(int64_t opcode, size_t index) {
+        switch (opcode) {
+            case 1: case 2: case 7: case 8:
+                return index == 2;
+            case 3:
+                return index == 0;
+        }
+        return false;
+    }
+
+    /// Handler for an instruction word which is not in the handler table,
+    /// either an unknown opcode, a bad mode digit, or non-zero mode digits
+    /// for parameters the opcode does not take (which are ignored)
+    static uint8_t get_slow_handler(int64_t raw) {
+        const auto opcode = raw % 100;
+        if (opcode != 99 && (opcode < 1 || opcode > 9)) {
+            return detail::InvalidOpcode;
+        }
+
+        auto modes = raw / 100;
+        int64_t key = opcode;
+        int64_t scale = 100;
+        for (size_t i = 0; i < parameter_count(opcode); i++) {
+            key += (modes % 10) * scale;
+            modes /= 10;
+            scale *= 10;
+        }
+
+        if (key < detail::HandlerTableSize && detail::HandlerTable[key] != detail::InvalidOpcode) {
+            return detail::HandlerTable[key];
+        }
+        return detail::InvalidMode;
+    }
+
+    /// Resolve the instruction at address to its handler and operand words
+    void decode(Instruction& insn, size_t address) const {
+        insn.raw = get(address);
+
+        if (insn.raw >= 0 && insn.raw < detail::HandlerTableSize && detail::HandlerTable[insn.raw] != detail::InvalidOpcode) {
+            insn.handler = detail::HandlerTable[insn.raw];
+        } else {
+            insn.handler = get_slow_handler(insn.raw);
+        }
+
+        const auto count = parameter_count(insn.raw % 100);
+        for (size_t i = 0; i < count; i++) {
+            insn.words[i] = get(address + i + 1);
+        }
+        insn.length = static_cast<uint8_t>(count + 1);
     }
 
-    int64_t get_output_address(int index) {
-        const auto val = get_address(index);
+    /// Turn insn, just decoded at address, and the instruction after it
+    /// into a superinstruction if they are one of the fused pairs:
+    ///
+    ///   SLT/SEQ x, y -> a; JNZ/JZ a, target   compare and branch
+    ///   ARB delta; ADD/MUL x, y -> [rb+a]     frame store
+    ///   ARB delta; JNZ 1/JZ 0, target         frame jump (call or return)
+    ///
+    /// Both have to lie within the first limit words, which the code map
+    /// covers, so a store to either drops the superinstruction. A jump into
+    /// the second runs it on its own as usual.
+    void fuse(Instruction& insn, size_t address, size_t limit) const {
+        const auto next = get(address + insn.length);
+        const auto opcode = insn.raw % 100;
+        if (opcode == 7 || opcode == 8) {
+            const auto jump = next % 100;
+            const auto dest_mode = insn.raw / 10000;
+            if (address + 7 > limit || (jump != 5 && jump != 6) || next >= 10000 ||
+                    (next / 100) % 10 != dest_mode || next / 1000 != 1 || get(address + 5) != insn.words[2]) {
+                return;
+            }
+            const auto handler = detail::get_compare_branch(insn.raw, jump);
+            if (handler != detail::InvalidOpcode) {
+                insn.handler = handler;
+                insn.words[3] = get(address + 6);
+                insn.length = 7;
+            }
+        } else if (insn.raw == 109) {
+            const auto handler = detail::get_frame_store(next);
+            if (handler != detail::InvalidOpcode && address + 6 <= limit) {
+                for (size_t i = 1; i < 4; i++) {
+                    insn.words[i] = get(address + i + 2);
+                }
+                insn.handler = handler;
+                insn.length = 6;
+                return;
+            }
 
-        switch (get_parameter_mode(index)) {
-            case ParameterMode::Immediate:
+            const auto condition = get(address + 3);
+            const bool always = (next % 100 == 5 && condition) || (next % 100 == 6 && !condition);
+            if (address + 5 > limit || !always || next >= 10000 || (next / 100) % 10 != 1) {
+                return;
+            }
+            const auto jump_handler = detail::get_frame_jump(next / 1000);
+            if (jump_handler != detail::InvalidOpcode) {
+                insn.handler = jump_handler;
+                insn.words[1] = get(address + 4);
+                insn.length = 5;
+            }
+        }
+    }
+
+    /// Return the decoded instruction at the program counter
+    const Instruction& fetch() {
+        auto& cache = *_decoded;
+        if (_pc < cache.instructions.size()) {
+            auto& insn = cache.instructions[_pc];
+            if (insn.length) {
+                return insn;
+            }
+            if (insn.invalidations < MaxInvalidations) {
+                // Memory may already differ from a fork's, so a shared cache
+                // is copied before it takes new entries
+                auto& own = writable_decoded();
+                auto& entry = own.instructions[_pc];
+                decode(entry, _pc);
+                if (_fuse) {
+                    fuse(entry, _pc, own.code_map.size());
+                }
+                for (size_t i = 0; i < entry.length; i++) {
+                    own.code_map[_pc + i] |= CodeMapBits::Decoded;
+                }
+                if (!entry.patched && is_patched(_pc, entry.length)) {
+                    entry.patched = true;
+                    own.patched.push_back(_pc);
+                }
+                return entry;
+            }
+        }
+        // Outside of the program image, or self-modifying, nothing is cached
+        decode(_scratch, _pc);
+        return _scratch;
+    }
+
+    /// Drop any cached or compiled instruction which has a word at address
+    void invalidate(size_t address) {
+        auto& cache = writable_decoded();
+        forget_decoded(cache, address);
+        if (cache.code_map[address] & CodeMapBits::Compiled) {
+            _jit.invalidate(address);
+        }
+        if (cache.code_map[address] & CodeMapBits::Translated) {
+            _translated_written = true;
+        }
+        // Results only depend on the memoized functions' own code. That is
+        // still theirs, so the next store to it has to flush too.
+        if (cache.code_map[address] & CodeMapBits::Memoized) {
+            _memo.flush();
+        }
+        cache.code_map[address] &= CodeMapBits::Memoized;
+    }
+
+    /// Run compiled blocks from the program counter, if there are any
+    void enter_jit() {
+        // Compiled code isn't counted, a profiling build stays interpreted
+#if !defined(AOC_PROFILE)
+        while (_jit.enabled() && !_trace_branches && !_zobrist.enabled()) {
+            // Compiled code writes straight to memory and the code map
+            auto& memory = writable_memory();
+            auto& cache = writable_decoded();
+            JitContext ctx{ memory.data(), memory.size(), _relative_base,
+                cache.code_map.data(), cache.code_map.size(), _pc, 0, 0 };
+
+            const auto exit = _jit.execute(ctx);
+            _pc = ctx.pc;
+            _relative_base = ctx.relative_base;
+            if (exit != JitExit::SelfModified) {
+                break;
+            }
+            invalidate(ctx.address);
+        }
+#endif
+    }
+
+    /// Raise the error the operand fetch would have hit for an instruction
+    /// which has a bad parameter mode
+    [[noreturn]] void throw_invalid_mode(const Instruction& insn) const {
+        const auto opcode = insn.raw % 100;
+        auto modes = insn.raw / 100;
+        for (size_t i = 0; i < parameter_count(opcode); i++) {
+            const auto mode = modes % 10;
+            if (mode == 1 && is_output_parameter(opcode, i)) {
                 throw std::runtime_error("Immediate mode not supported for output address");
-            case ParameterMode::Position:
-                return val;
-            case ParameterMode::Relative:
-                return _relative_base + val;
+            }
+            if (mode > 2) {
+                break;
+            }
+            modes /= 10;
         }
         throw std::runtime_error("Invalid parameter mode");
     }
+
+    static HaltCode get_halt_code(Step step) {
+        switch (step) {
+            case Step::Output:
+                return HaltCode::HasOutput;
+            case Step::NeedsInput:
+                return HaltCode::NeedsInput;
+            case Step::Halt:
+                return HaltCode::Halt;
+            case Step::Next:
+                break;
+        }
+        return HaltCode::Error;
+    }
+
+    /// Value of parameter index, specialised for its mode
+    template <ParameterMode Mode>
+    int64_t get_parameter(const Instruction& insn, int index) const {
+        const auto val = insn.words[index];
+        if constexpr (Mode == ParameterMode::Immediate) {
+            return val;
+        } else if constexpr (Mode == ParameterMode::Position) {
+            return get(val);
+        } else {
+            return get(_relative_base + val);
+        }
+    }
+
+    /// Address written by parameter index, specialised for its mode
+    template <ParameterMode Mode>
+    int64_t get_output_address(const Instruction& insn, int index) const {
+        static_assert(Mode != ParameterMode::Immediate, "Immediate mode not supported for output address");
+        const auto val = insn.words[index];
+        if constexpr (Mode == ParameterMode::Position) {
+            return val;
+        } else {
+            return _relative_base + val;
+        }
+    }
+
+    /// Execute one instruction, with the operand fetch specialised for the
+    /// parameter modes M1, M2 and M3
+    template <int64_t Opcode, ParameterMode M1, ParameterMode M2, ParameterMode M3, typename Budget, typename Io>
+    Step execute(const Instruction& insn, Io& io) {
+        if constexpr (Opcode == 1) { // add
+            const auto d1 = get_parameter<M1>(insn, 0);
+            const auto d2 = get_parameter<M2>(insn, 1);
+            const auto d3 = get_output_address<M3>(insn, 2);
+            __DEBUG_PRINT("ADD: " << d1 << "," << d2 << " -> " << d3);
+            store(d3, d1 + d2);
+            _pc += 4;
+        } else if constexpr (Opcode == 2) { // multiply
+            const auto d1 = get_parameter<M1>(insn, 0);
+            const auto d2 = get_parameter<M2>(insn, 1);
+            const auto d3 = get_output_address<M3>(insn, 2);
+            __DEBUG_PRINT("MUL: " << d1 << "," << d2 << " -> " << d3);
+            store(d3, d1 * d2);
+            _pc += 4;
+        } else if constexpr (Opcode == 3) { // input
+            int64_t value;
+            if (!io.read(value)) {
+                __PROFILE(_profile.stalled(_pc, insn.raw));
+                return Step::NeedsInput;
+            }
+
+            const auto address = get_output_address<M1>(insn, 0);
+            __DEBUG_PRINT("IN: " << value << " -> " << address);
+            if (_trace) {
+                _trace->input(value);
+            }
+            store(address, value);
+            _pc += 2;
+        } else if constexpr (Opcode == 4) { // output
+            const auto value = get_parameter<M1>(insn, 0);
+            __DEBUG_PRINT("OUT: " << value);
+            if (!io.write(value)) {
+                // Nothing written, the same instruction runs again next time
+                __PROFILE(_profile.stalled(_pc, insn.raw));
+                return Step::Output;
+            }
+            if (_trace) {
+                _trace->output(value);
+            }
+            _pc += 2;
+            if (!Io::Inline && _pause_on_output) {
+                return Step::Output;
+            }
+        } else if constexpr (Opcode == 5) { // Jump if true
+            const auto value = get_parameter<M1>(insn, 0);
+            const auto new_pc = get_parameter<M2>(insn, 1);
+            __DEBUG_PRINT("JNZ: " << value << "," << new_pc);
+            __PROFILE(_profile.branch(_pc, value != 0));
+            if (value) {
+                __PROFILE(_profile.jumped(_pc, new_pc, M2 != ParameterMode::Immediate));
+                if (_trace_branches) {
+                    _trace->branch(new_pc);
+                }
+                _pc = new_pc;
+                if constexpr (Budget::Compiled) {
+                    enter_jit();
+                }
+            } else {
+                _pc += 3;
+            }
+        } else if constexpr (Opcode == 6) { // Jump if false
+            const auto value = get_parameter<M1>(insn, 0);
+            const auto new_pc = get_parameter<M2>(insn, 1);
+            __DEBUG_PRINT("JZ: " << value << "," << new_pc);
+            __PROFILE(_profile.branch(_pc, value == 0));
+            if (!value) {
+                __PROFILE(_profile.jumped(_pc, new_pc, M2 != ParameterMode::Immediate));
+                if (_trace_branches) {
+                    _trace->branch(new_pc);
+                }
+                _pc = new_pc;
+                if constexpr (Budget::Compiled) {
+                    enter_jit();
+                }
+            } else {
+                _pc += 3;
+            }
+        } else if constexpr (Opcode == 7) { // Less than
+            const auto d1 = get_parameter<M1>(insn, 0);
+            const auto d2 = get_parameter<M2>(insn, 1);
+            const auto d3 = get_output_address<M3>(insn, 2);
+            __DEBUG_PRINT("SLT: " << d1 << "," << d2 << " -> " << d3);
+            store(d3, d1 < d2);
+            _pc += 4;
+        } else if constexpr (Opcode == 8) { // Equal
+            const auto d1 = get_parameter<M1>(insn, 0);
+            const auto d2 = get_parameter<M2>(insn, 1);
+            const auto d3 = get_output_address<M3>(insn, 2);
+            __DEBUG_PRINT("SEQ: " << d1 << "," << d2 << " -> " << d3);
+            store(d3, d1 == d2);
+            _pc += 4;
+        } else if constexpr (Opcode == 9) { // Adjust relative base
+            const auto d1 = get_parameter<M1>(insn, 0);
+            __DEBUG_PRINT("ARB: " << d1);
+            __PROFILE(_profile.adjusted(d1));
+            _relative_base += d1;
+            _pc += 2;
+        } else { // halt
+            static_assert(Opcode == 99, "Unhandled opcode");
+            return Step::Halt;
+        }
+        return Step::Next;
+    }
+
+    /// Compare and branch superinstruction. Budgeted runs take one dispatch
+    /// per instruction, so they only run the compare.
+    template <int64_t Opcode, ParameterMode M1, ParameterMode M2, ParameterMode M3, int64_t Jump, typename Budget, typename Io>
+    Step execute_compare_branch(const Instruction& insn, Io& io) {
+        if constexpr (Budget::Limited) {
+            return execute<Opcode, M1, M2, M3, Budget>(insn, io);
+        } else {
+            const auto d1 = get_parameter<M1>(insn, 0);
+            const auto d2 = get_parameter<M2>(insn, 1);
+            const auto d3 = get_output_address<M3>(insn, 2);
+            const auto target = insn.words[3];
+            const bool value = Opcode == 7 ? d1 < d2 : d1 == d2;
+            const auto pc = _pc;
+            __DEBUG_PRINT((Opcode == 7 ? "SLT+" : "SEQ+") << (Jump == 5 ? "JNZ: " : "JZ: ") << d1 << "," << d2 << " -> " << d3 << "," << target);
+            store(d3, value);
+            if (static_cast<uint64_t>(d3 - pc) < MaxFusedLength) {
+                // The compare overwrote the pair, the jump is decoded again
+                _pc = pc + 4;
+                return Step::Next;
+            }
+            if (value == (Jump == 5)) {
+                if (_trace_branches) {
+                    _trace->branch(target);
+                }
+                _pc = target;
+                if constexpr (Budget::Compiled) {
+                    enter_jit();
+                }
+            } else {
+                _pc = pc + 7;
+            }
+            return Step::Next;
+        }
+    }
+
+    /// Frame store superinstruction, ARB delta then ADD or MUL to [rb+a]
+    template <int64_t Opcode, ParameterMode M1, ParameterMode M2, typename Budget, typename Io>
+    Step execute_frame_store(const Instruction& insn, Io& io) {
+        if constexpr (Budget::Limited) {
+            return execute<9, ParameterMode::Immediate, ParameterMode::Position, ParameterMode::Position, Budget>(insn, io);
+        } else {
+            _relative_base += insn.words[0];
+            const auto d1 = get_parameter<M1>(insn, 1);
+            const auto d2 = get_parameter<M2>(insn, 2);
+            const auto d3 = _relative_base + insn.words[3];
+            __DEBUG_PRINT("ARB+" << (Opcode == 1 ? "ADD: " : "MUL: ") << insn.words[0] << "," << d1 << "," << d2 << " -> " << d3);
+            store(d3, Opcode == 1 ? d1 + d2 : d1 * d2);
+            _pc += 6;
+            return Step::Next;
+        }
+    }
+
+    /// Frame jump superinstruction, ARB delta then an unconditional jump
+    template <ParameterMode MT, typename Budget, typename Io>
+    Step execute_frame_jump(const Instruction& insn, Io& io) {
+        if constexpr (Budget::Limited) {
+            return execute<9, ParameterMode::Immediate, ParameterMode::Position, ParameterMode::Position, Budget>(insn, io);
+        } else {
+            _relative_base += insn.words[0];
+            const auto target = get_parameter<MT>(insn, 1);
+            __DEBUG_PRINT("ARB+JMP: " << insn.words[0] << "," << target);
+            if (_trace_branches) {
+                _trace->branch(target);
+            }
+            _pc = target;
+            if constexpr (Budget::Compiled) {
+                enter_jit();
+            }
+            return Step::Next;
+        }
+    }
+
 };
 
 };
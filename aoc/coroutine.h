@@ -0,0 +1,181 @@
+#pragma once
+
+#include "computer.h"
+
+#if defined(__cpp_impl_coroutine)
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace aoc19 {
+
+/*
+Coroutine front end for driving Computers, built only as C++20 (see
+intcode_coroutines() in CMakeLists.txt). A driver is a coroutine returning
+Driver which talks to its VMs in straight-line code:
+
+    aoc19::Driver robot(aoc19::Vm& vm) {
+        while (const auto colour = co_await vm.read()) {
+            const auto turn = co_await vm.read();
+            ...
+            vm.write(camera);
+        }
+    }
+
+read() runs the program until it halts or waits for input, and hands out
+what it wrote one value at a time, so the VM is entered once per input
+rather than once per output. A driver which reads from a VM waiting for
+input is suspended until something else, another driver or the caller,
+write()s to that VM.
+*/
+
+/// A driver coroutine, which starts running as soon as it is called
+class Driver
+{
+public:
+    class promise_type {
+    public:
+        std::exception_ptr error;
+
+        Driver get_return_object() {
+            return Driver(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_never initial_suspend() noexcept {
+            return {};
+        }
+
+        std::suspend_always final_suspend() noexcept {
+            return {};
+        }
+
+        void return_void() {
+        }
+
+        void unhandled_exception() {
+            error = std::current_exception();
+        }
+    };
+
+    Driver(Driver&& other) noexcept
+        : _handle(std::exchange(other._handle, {})) {
+    }
+
+    Driver(const Driver&) = delete;
+    Driver& operator=(const Driver&) = delete;
+    Driver& operator=(Driver&&) = delete;
+
+    ~Driver() {
+        if (_handle) {
+            _handle.destroy();
+        }
+    }
+
+    /// Whether the driver has returned, rethrowing anything it threw
+    bool done() const {
+        if (_handle.promise().error) {
+            std::rethrow_exception(_handle.promise().error);
+        }
+        return _handle.done();
+    }
+
+private:
+    explicit Driver(std::coroutine_handle<promise_type> handle)
+        : _handle(handle) {
+    }
+
+    std::coroutine_handle<promise_type> _handle;
+};
+
+/// A Computer as seen by a driver. Make a new one after initialize().
+class Vm
+{
+public:
+    explicit Vm(Computer& computer)
+        : _computer(computer) {
+    }
+
+    Vm(const Vm&) = delete;
+    Vm& operator=(const Vm&) = delete;
+
+    class Read {
+    public:
+        Vm& vm;
+
+        bool await_ready() {
+            return vm.fill();
+        }
+
+        void await_suspend(std::coroutine_handle<> driver) {
+            vm._waiting = driver;
+        }
+
+        std::optional<int64_t> await_resume() {
+            if (vm._next < vm._outputs.size()) {
+                return vm._outputs[vm._next++];
+            }
+            return std::nullopt;
+        }
+    };
+
+    /// co_await for the next output, nothing once the program has halted
+    Read read() {
+        return Read{ *this };
+    }
+
+    /// Give the program input, resuming the driver waiting to read() if
+    /// that was all it needed
+    void write(int64_t value) {
+        _computer.set_input(value);
+        if (_waiting && fill()) {
+            std::exchange(_waiting, {}).resume();
+        }
+    }
+
+    /// Whether a driver is suspended until the program is given input
+    bool waiting() const {
+        return static_cast<bool>(_waiting);
+    }
+
+    bool halted() const {
+        return _halted && _next == _outputs.size();
+    }
+
+    Computer& computer() {
+        return _computer;
+    }
+
+private:
+    /// Whether read() has something to return, an output or the end,
+    /// running the program for more if not
+    bool fill() {
+        if (_next < _outputs.size() || _halted) {
+            return true;
+        }
+        _outputs.clear();
+        _next = 0;
+        switch (_computer.run_with(NoSource{}, BufferSink{ _outputs })) {
+            case HaltCode::Halt:
+                _halted = true;
+                return true;
+            case HaltCode::NeedsInput:
+                return !_outputs.empty();
+            default:
+                throw std::runtime_error("IntCode program failed");
+        }
+    }
+
+    Computer& _computer;
+    std::vector<int64_t> _outputs;
+    size_t _next = 0;
+    bool _halted = false;
+    std::coroutine_handle<> _waiting;
+};
+
+};
+
+#endif
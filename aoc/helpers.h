@@ -33,7 +33,7 @@ namespace aoc {
         print_result(2, part2);
     };
 
-    auto open_argv_1(int argc, char **argv) {
+    inline auto open_argv_1(int argc, char **argv) {
         if (argc < 2) {
             throw std::runtime_error("Insufficient arguments");
         }
@@ -43,19 +43,19 @@ namespace aoc {
         return f;
     };
 
-    std::ostream& bold_on(std::ostream& os) {
+    inline std::ostream& bold_on(std::ostream& os) {
         return os << "\e[1m";
     }
 
-    std::ostream& bold_off(std::ostream& os) {
+    inline std::ostream& bold_off(std::ostream& os) {
         return os << "\e[0m";
     }
 
-    std::ostream& cls(std::ostream& os) {
+    inline std::ostream& cls(std::ostream& os) {
         return os << "\033[2J\033[1;1H";
     }
 
-    bool getline(std::istream& s, std::string& out, const std::string_view delims) {
+    inline bool getline(std::istream& s, std::string& out, const std::string_view delims) {
         char c;
         out.resize(0);
         while (s.good() && (c = s.get())) {
@@ -71,10 +71,10 @@ namespace aoc {
         }
         return !out.empty() || s.good();
     }
-    bool getline(std::istream& s, std::string& out, const char delim) {
+    inline bool getline(std::istream& s, std::string& out, const char delim) {
         return getline(s, out, std::string_view(&delim, 1));
     }
-    bool getline(std::istream& s, std::string& out) {
+    inline bool getline(std::istream& s, std::string& out) {
         char c;
         out.resize(0);
         while (s.good() && (c = s.get())) {
@@ -94,7 +94,7 @@ namespace aoc {
     }
 
     using UnaryIntFunction = std::function<void(int64_t)>;
-    void parse_as_integers(std::istream& s, const char delim, UnaryIntFunction op) {
+    inline void parse_as_integers(std::istream& s, const char delim, UnaryIntFunction op) {
         std::string l;
         while (getline(s, l, delim)) {
             try {
@@ -103,7 +103,7 @@ namespace aoc {
             } catch (...) { }
         }
     }
-    void parse_as_integers(std::istream& s, const std::string_view delims, UnaryIntFunction op) {
+    inline void parse_as_integers(std::istream& s, const std::string_view delims, UnaryIntFunction op) {
         std::string l;
         while (getline(s, l, delims)) {
             try {
@@ -112,7 +112,7 @@ namespace aoc {
             } catch (...) { }
         }
     }
-    void parse_as_integers(std::istream& s, UnaryIntFunction op) {
+    inline void parse_as_integers(std::istream& s, UnaryIntFunction op) {
         std::string l;
         while (getline(s, l)) {
             try {
@@ -121,7 +121,7 @@ namespace aoc {
             } catch (...) { }
         }
     }
-    void parse_as_integers(const std::string& s, const char delim, UnaryIntFunction op) {
+    inline void parse_as_integers(const std::string& s, const char delim, UnaryIntFunction op) {
         std::stringstream ss(s);
         std::string l;
         while (getline(ss, l, delim)) {
@@ -131,7 +131,7 @@ namespace aoc {
             } catch (...) { }
         }
     }
-    void parse_as_integers(const std::string& s, const std::string_view delims, UnaryIntFunction op) {
+    inline void parse_as_integers(const std::string& s, const std::string_view delims, UnaryIntFunction op) {
         std::stringstream ss(s);
         std::string l;
         while (getline(ss, l, delims)) {
@@ -143,7 +143,7 @@ namespace aoc {
     }
 
     // Needs to be a lambda due to use of auto
-    auto calculate_time = [](const auto start) {
+    const auto calculate_time = [](const auto start) {
         const auto end = std::chrono::high_resolution_clock::now();
 
         // Calculating total time taken by the program.
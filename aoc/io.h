@@ -0,0 +1,176 @@
+#pragma once
+
+#include "channel.h"
+
+#include <array>
+#include <cstdint>
+#include <queue>
+#include <utility>
+#include <vector>
+
+namespace aoc19 {
+
+using InputOutputs = std::queue<int64_t>;
+
+/*
+Input sources and output sinks for Computer::run_with(), which pulls each
+input from a source and pushes each output into a sink as the program runs,
+rather than returning to the driver for every value.
+
+A source has `bool read(int64_t& value)`, false if there is nothing to read
+yet: run_with() then returns NeedsInput, and reads again at the same
+instruction next time.
+
+A sink has `bool write(int64_t value)`, false if it can't take the value
+yet: run_with() then returns HasOutput with nothing written, and writes it
+again next time. Its `Inline` says whether it deals with every value itself;
+if not, a Computer which pauses on output returns HasOutput after each one
+written, as run() does.
+*/
+
+/// Nothing to read, for programs which take no input (or only what was
+/// queued with set_input())
+class NoSource {
+public:
+    bool read(int64_t&) {
+        return false;
+    }
+};
+
+class QueueSource {
+public:
+    InputOutputs& queue;
+
+    bool read(int64_t& value) {
+        if (queue.empty()) {
+            return false;
+        }
+        value = queue.front(); queue.pop();
+        return true;
+    }
+};
+
+class QueueSink {
+public:
+    static constexpr bool Inline = false;
+
+    InputOutputs& queue;
+
+    bool write(int64_t value) {
+        queue.push(value);
+        return true;
+    }
+};
+
+/// Reads values in order, then nothing
+class BufferSource {
+public:
+    const std::vector<int64_t>& values;
+    size_t next = 0;
+
+    bool read(int64_t& value) {
+        if (next == values.size()) {
+            return false;
+        }
+        value = values[next++];
+        return true;
+    }
+};
+
+/// Appends every value
+class BufferSink {
+public:
+    static constexpr bool Inline = true;
+
+    std::vector<int64_t>& values;
+
+    bool write(int64_t value) {
+        values.push_back(value);
+        return true;
+    }
+};
+
+/// Waits on the channel if it is blocking
+class ChannelSource {
+public:
+    Channel& channel;
+
+    bool read(int64_t& value) {
+        return channel.mode() == Channel::Mode::Blocking ? channel.pop(value) : channel.try_pop(value);
+    }
+};
+
+class ChannelSink {
+public:
+    static constexpr bool Inline = false;
+
+    Channel& channel;
+
+    bool write(int64_t value) {
+        return channel.mode() == Channel::Mode::Blocking ? channel.push(value) : channel.try_push(value);
+    }
+};
+
+/// Asks f() for every input, there always is one
+template <typename F>
+class CallbackSource {
+public:
+    F f;
+
+    bool read(int64_t& value) {
+        value = f();
+        return true;
+    }
+};
+
+/// Calls f(value) for every output
+template <typename F>
+class CallbackSink {
+public:
+    static constexpr bool Inline = true;
+
+    F f;
+
+    bool write(int64_t value) {
+        f(value);
+        return true;
+    }
+};
+
+/// Calls f(values) with every N outputs, for programs which write records
+/// like (x, y, tile)
+template <size_t N, typename F>
+class GroupSink {
+public:
+    static constexpr bool Inline = true;
+
+    F f;
+    std::array<int64_t, N> values{};
+    size_t used = 0;
+
+    bool write(int64_t value) {
+        values[used++] = value;
+        if (used == N) {
+            used = 0;
+            f(values);
+        }
+        return true;
+    }
+};
+
+template <typename F>
+CallbackSource<F> make_source(F f) {
+    return CallbackSource<F>{ std::move(f) };
+}
+
+template <typename F>
+CallbackSink<F> make_sink(F f) {
+    return CallbackSink<F>{ std::move(f) };
+}
+
+template <size_t N, typename F>
+GroupSink<N, F> make_group_sink(F f) {
+    return GroupSink<N, F>{ std::move(f) };
+}
+
+};
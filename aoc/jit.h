@@ -0,0 +1,495 @@
+#pragma once
+
+#include "program.h"
+
+#include <cstdint>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__) && defined(__unix__)
+#define AOC_HAS_JIT 1
+#include <sys/mman.h>
+#else
+#define AOC_HAS_JIT 0
+#endif
+
+namespace aoc19 {
+
+    /// Bits of the per-word code map shared by the interpreter and the JIT.
+    /// A store to a word with any bit set must invalidate cached code.
+    enum CodeMapBits : uint8_t {
+        Decoded = 1,
+        Compiled = 2,
+        Translated = 4,     // ahead of time, see AotComputer
+        Memoized = 8,       // in a function Memo keeps results for
+    };
+
+    /// Why compiled code handed control back
+    enum class JitExit : uint64_t {
+        Continue = 0,   // ended on a jump or at the block limit, pc is the next block
+        Interpret,      // next instruction needs the interpreter (I/O, halt, out of bounds)
+        SelfModified,   // a store hit cached code, address needs invalidating
+    };
+
+    /// State shared between a Computer and its compiled blocks. The layout
+    /// is read directly by the generated code.
+    struct JitContext {
+        int64_t* memory;
+        uint64_t size;
+        uint64_t relative_base;
+        uint8_t* code_map;
+        uint64_t code_map_size;
+        uint64_t pc;
+        uint64_t exit;
+        uint64_t address;
+    };
+
+/*
+Basic block compiler for x86-64 (System V). Blocks are straight runs of
+ADD/MUL/SLT/SEQ/ARB ending at a JNZ/JZ, or just before an IN/OUT/HALT which
+are left to the interpreter. A block is compiled once its entry pc has been
+jumped to HotThreshold times.
+
+Register use in generated code:
+    rbx - JitContext*
+    r12 - memory base
+    r13 - memory size (words)
+    r14 - relative base
+    r15 - code map base
+    rax, rcx, rdx - scratch, rcx always holds the address being accessed
+
+Any load or store outside of memory leaves the block before the instruction
+runs, so the interpreter can resize memory. Every store checks the code map
+and leaves right after the store if it hit cached code.
+*/
+class Jit
+{
+    using Block = void (*)(JitContext*);
+
+    /// Entry pc must be jumped to this many times before it is compiled
+    static constexpr uint32_t HotThreshold = 16;
+    static constexpr size_t MaxBlockInstructions = 64;
+    static constexpr size_t ArenaSize = 1 << 20;
+    /// Blocks whose code keeps being overwritten are left to the interpreter
+    static constexpr uint32_t MaxInvalidations = 2;
+
+    class Entry {
+    public:
+        Block code = nullptr;
+        uint32_t hits = 0;
+        uint32_t invalidations = 0;
+        bool uncompilable = false;
+    };
+
+    class Range {
+    public:
+        size_t start;
+        size_t end;
+    };
+
+public:
+    Jit()
+        : _enabled(enabled_by_default())
+    { }
+
+    /// Copies start without compiled code, as it was built from the
+    /// original's memory
+    Jit(const Jit& other)
+        : _enabled(other._enabled)
+    { }
+
+    Jit& operator=(const Jit& other) {
+        if (this != &other) {
+            reset();
+            _enabled = other._enabled;
+        }
+        return *this;
+    }
+
+    ~Jit() {
+#if AOC_HAS_JIT
+        if (_arena) {
+            ::munmap(_arena, ArenaSize);
+        }
+#endif
+    }
+
+    /// Set AOC_JIT=1 in the environment to turn the JIT on for every Computer
+    static bool enabled_by_default() {
+        const char* env = std::getenv("AOC_JIT");
+        return env && env[0] == '1';
+    }
+
+    static constexpr bool supported() {
+        return AOC_HAS_JIT;
+    }
+
+    bool enabled() const {
+        return supported() && _enabled;
+    }
+
+    void set_enabled(bool v) {
+        _enabled = v;
+        if (!v) {
+            reset();
+        }
+    }
+
+    /// Forget all compiled code, for when memory is reloaded
+    void reset() {
+        _entries.clear();
+        _ranges.clear();
+        _used = 0;
+    }
+
+    /// Keep only the compiled blocks for which keep(start, end) is true, for
+    /// when memory is reloaded and most of the code is unchanged
+    template <typename Predicate>
+    void retain(Predicate keep) {
+        for (size_t i = 0; i < _ranges.size(); ) {
+            const auto& r = _ranges[i];
+            if (!keep(r.start, r.end)) {
+                _entries[r.start] = Entry{};
+                _ranges[i] = _ranges.back();
+                _ranges.pop_back();
+            } else {
+                i++;
+            }
+        }
+    }
+
+    /// Set the Compiled bit for every word of every compiled block
+    void mark(uint8_t* code_map) const {
+        for (const auto& r : _ranges) {
+            for (size_t p = r.start; p < r.end; p++) {
+                code_map[p] |= CodeMapBits::Compiled;
+            }
+        }
+    }
+
+    /// Drop every compiled block containing address
+    void invalidate(size_t address) {
+        for (size_t i = 0; i < _ranges.size(); ) {
+            const auto& r = _ranges[i];
+            if (address >= r.start && address < r.end) {
+                auto& entry = _entries[r.start];
+                entry.code = nullptr;
+                entry.hits = 0;
+                entry.uncompilable = ++entry.invalidations >= MaxInvalidations;
+                _ranges[i] = _ranges.back();
+                _ranges.pop_back();
+            } else {
+                i++;
+            }
+        }
+    }
+
+    /// Run compiled blocks from ctx.pc for as long as there are any
+    JitExit execute(JitContext& ctx) {
+#if AOC_HAS_JIT
+        if (_entries.size() < ctx.code_map_size) {
+            _entries.resize(ctx.code_map_size);
+        }
+
+        while (ctx.pc < _entries.size()) {
+            auto& entry = _entries[ctx.pc];
+            if (!entry.code) {
+                if (entry.uncompilable || ++entry.hits < HotThreshold || !compile(ctx)) {
+                    break;
+                }
+            }
+
+            entry.code(&ctx);
+
+            const auto exit = static_cast<JitExit>(ctx.exit);
+            if (exit != JitExit::Continue) {
+                return exit;
+            }
+        }
+#else
+        (void)ctx;
+#endif
+        return JitExit::Interpret;
+    }
+
+private:
+    bool _enabled;
+    std::vector<Entry> _entries;
+    std::vector<Range> _ranges;
+    uint8_t* _arena = nullptr;
+    size_t _used = 0;
+
+#if AOC_HAS_JIT
+    /// Byte emitter for the handful of instruction forms the blocks use
+    class Assembler {
+    public:
+        std::vector<uint8_t> code;
+
+        void bytes(std::initializer_list<uint8_t> b) {
+            code.insert(code.end(), b);
+        }
+
+        void imm32(uint32_t v) {
+            for (int i = 0; i < 4; i++) {
+                code.push_back(static_cast<uint8_t>(v >> (i * 8)));
+            }
+        }
+
+        void imm64(uint64_t v) {
+            for (int i = 0; i < 8; i++) {
+                code.push_back(static_cast<uint8_t>(v >> (i * 8)));
+            }
+        }
+
+        /// Emit a rel32 jump (opcode bytes given) and return the patch offset
+        size_t jump(std::initializer_list<uint8_t> op) {
+            bytes(op);
+            imm32(0);
+            return code.size() - 4;
+        }
+
+        void bind(size_t patch, size_t target) {
+            const auto rel = static_cast<int32_t>(target - (patch + 4));
+            std::memcpy(&code[patch], &rel, sizeof(rel));
+        }
+
+        size_t here() const {
+            return code.size();
+        }
+
+        static uint8_t field(size_t offset) {
+            return static_cast<uint8_t>(offset);
+        }
+
+        // mov rax/rcx/rdx, imm64
+        void mov_rax(int64_t v) { bytes({ 0x48, 0xB8 }); imm64(v); }
+        void mov_rcx(int64_t v) { bytes({ 0x48, 0xB9 }); imm64(v); }
+        void mov_rdx(int64_t v) { bytes({ 0x48, 0xBA }); imm64(v); }
+
+        // mov qword [rbx + offset], imm32 / rax / rcx / rdx
+        void store_field(size_t offset, uint32_t v) { bytes({ 0x48, 0xC7, 0x43, field(offset) }); imm32(v); }
+        void store_field_rax(size_t offset) { bytes({ 0x48, 0x89, 0x43, field(offset) }); }
+        void store_field_rcx(size_t offset) { bytes({ 0x48, 0x89, 0x4B, field(offset) }); }
+        void store_field_rdx(size_t offset) { bytes({ 0x48, 0x89, 0x53, field(offset) }); }
+    };
+
+    enum class Mode {
+        Position = 0,
+        Immediate,
+        Relative,
+    };
+
+    /// Put the address of a position/relative parameter in rcx and leave
+    /// to exit if it is outside of memory
+    static void emit_address(Assembler& a, Mode mode, int64_t word, std::vector<size_t>& exit) {
+        a.mov_rcx(word);
+        if (mode == Mode::Relative) {
+            a.bytes({ 0x4C, 0x01, 0xF1 });              // add rcx, r14
+        }
+        a.bytes({ 0x4C, 0x39, 0xE9 });                  // cmp rcx, r13
+        exit.push_back(a.jump({ 0x0F, 0x83 }));         // jae exit
+    }
+
+    /// Load a parameter into rax (reg == 0) or rdx (reg == 2)
+    static void emit_load(Assembler& a, int reg, Mode mode, int64_t word, std::vector<size_t>& exit) {
+        if (mode == Mode::Immediate) {
+            reg == 0 ? a.mov_rax(word) : a.mov_rdx(word);
+            return;
+        }
+        emit_address(a, mode, word, exit);
+        a.bytes({ 0x49, 0x8B, static_cast<uint8_t>(reg == 0 ? 0x04 : 0x14), 0xCC }); // mov reg, [r12 + rcx*8]
+    }
+
+    /// Compile the block at ctx.pc into the arena
+    bool compile(JitContext& ctx) {
+        auto& entry = _entries[ctx.pc];
+
+        if (!_arena) {
+            void* p = ::mmap(nullptr, ArenaSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED) {
+                _enabled = false;
+                return false;
+            }
+            _arena = static_cast<uint8_t*>(p);
+        }
+
+        Assembler a;
+        // Jumps to patch: leave before instruction i, and leave after a
+        // store in instruction i hit cached code
+        std::vector<std::vector<size_t>> before;
+        std::vector<std::vector<size_t>> modified;
+        std::vector<size_t> pcs;
+        std::vector<size_t> epilogue;
+
+        // Prologue
+        a.bytes({ 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57 }); // push rbx, r12-r15
+        a.bytes({ 0x48, 0x89, 0xFB });                                   // mov rbx, rdi
+        a.bytes({ 0x4C, 0x8B, 0x63, a.field(offsetof(JitContext, memory)) });
+        a.bytes({ 0x4C, 0x8B, 0x6B, a.field(offsetof(JitContext, size)) });
+        a.bytes({ 0x4C, 0x8B, 0x73, a.field(offsetof(JitContext, relative_base)) });
+        a.bytes({ 0x4C, 0x8B, 0x7B, a.field(offsetof(JitContext, code_map)) });
+
+        const auto word = [&](size_t address) {
+            return ctx.memory[address];
+        };
+
+        size_t pc = ctx.pc;
+        bool ended = false;
+        while (!ended && pcs.size() < MaxBlockInstructions) {
+            if (pc >= ctx.code_map_size || pc >= ctx.size) {
+                break;
+            }
+
+            const auto raw = word(pc);
+            const auto opcode = raw % 100;
+            // I/O, halt and anything invalid is left to the interpreter
+            const auto count = opcode == 3 || opcode == 4 ? 0 : parameter_count(opcode);
+            if (!count || raw < 0 || pc + count >= ctx.code_map_size || pc + count >= ctx.size) {
+                break;
+            }
+
+            Mode modes[3] = { Mode::Position, Mode::Position, Mode::Position };
+            int64_t words[3] = { 0, 0, 0 };
+            bool valid = true;
+            auto digits = raw / 100;
+            for (size_t i = 0; i < count; i++) {
+                const auto m = digits % 10;
+                digits /= 10;
+                valid = valid && m <= 2;
+                modes[i] = static_cast<Mode>(m);
+                words[i] = word(pc + i + 1);
+            }
+            const bool writes = count == 3;
+            if (!valid || (writes && modes[2] == Mode::Immediate)) {
+                break;
+            }
+
+            const size_t index = pcs.size();
+            pcs.push_back(pc);
+            before.emplace_back();
+            modified.emplace_back();
+            auto& exit = before.back();
+            const size_t next = pc + count + 1;
+
+            switch (opcode) {
+                case 1: case 2: case 7: case 8:
+                    emit_load(a, 0, modes[0], words[0], exit);
+                    emit_load(a, 2, modes[1], words[1], exit);
+                    switch (opcode) {
+                        case 1: a.bytes({ 0x48, 0x01, 0xD0 }); break;                // add rax, rdx
+                        case 2: a.bytes({ 0x48, 0x0F, 0xAF, 0xC2 }); break;          // imul rax, rdx
+                        case 7: a.bytes({ 0x48, 0x39, 0xD0, 0x0F, 0x9C, 0xC0, 0x0F, 0xB6, 0xC0 }); break; // cmp; setl al; movzx eax, al
+                        case 8: a.bytes({ 0x48, 0x39, 0xD0, 0x0F, 0x94, 0xC0, 0x0F, 0xB6, 0xC0 }); break; // cmp; sete al; movzx eax, al
+                    }
+                    emit_address(a, modes[2], words[2], exit);
+                    a.bytes({ 0x49, 0x89, 0x04, 0xCC });                             // mov [r12 + rcx*8], rax
+                    {
+                        // Guard against writes to cached code
+                        a.bytes({ 0x48, 0x3B, 0x4B, a.field(offsetof(JitContext, code_map_size)) }); // cmp rcx, [rbx + code_map_size]
+                        const auto skip = a.jump({ 0x0F, 0x83 });                    // jae skip
+                        a.bytes({ 0x41, 0x80, 0x3C, 0x0F, 0x00 });                   // cmp byte [r15 + rcx], 0
+                        modified[index].push_back(a.jump({ 0x0F, 0x85 }));           // jne modified
+                        a.bind(skip, a.here());
+                    }
+                    break;
+                case 9:
+                    emit_load(a, 0, modes[0], words[0], exit);
+                    a.bytes({ 0x49, 0x01, 0xC6 });                                   // add r14, rax
+                    break;
+                case 5: case 6:
+                {
+                    emit_load(a, 0, modes[0], words[0], exit);
+                    emit_load(a, 2, modes[1], words[1], exit);
+                    a.bytes({ 0x48, 0x85, 0xC0 });                                   // test rax, rax
+                    const auto not_taken = a.jump({ 0x0F, static_cast<uint8_t>(opcode == 5 ? 0x84 : 0x85) });
+                    a.store_field_rdx(offsetof(JitContext, pc));
+                    a.store_field(offsetof(JitContext, exit), static_cast<uint32_t>(JitExit::Continue));
+                    epilogue.push_back(a.jump({ 0xE9 }));
+                    a.bind(not_taken, a.here());
+                    ended = true;
+                    break;
+                }
+            }
+            pc = next;
+        }
+
+        if (pcs.empty()) {
+            entry.uncompilable = true;
+            return false;
+        }
+
+        // Fall out of the end of the block
+        const bool at_limit = !ended && pcs.size() == MaxBlockInstructions;
+        a.mov_rax(pc);
+        a.store_field_rax(offsetof(JitContext, pc));
+        a.store_field(offsetof(JitContext, exit),
+            static_cast<uint32_t>(ended || at_limit ? JitExit::Continue : JitExit::Interpret));
+        epilogue.push_back(a.jump({ 0xE9 }));
+
+        // Side exits
+        for (size_t i = 0; i < pcs.size(); i++) {
+            if (!before[i].empty()) {
+                const auto target = a.here();
+                for (const auto p : before[i]) {
+                    a.bind(p, target);
+                }
+                a.mov_rax(pcs[i]);
+                a.store_field_rax(offsetof(JitContext, pc));
+                a.store_field(offsetof(JitContext, exit), static_cast<uint32_t>(JitExit::Interpret));
+                epilogue.push_back(a.jump({ 0xE9 }));
+            }
+            if (!modified[i].empty()) {
+                const auto target = a.here();
+                for (const auto p : modified[i]) {
+                    a.bind(p, target);
+                }
+                a.store_field_rcx(offsetof(JitContext, address));
+                a.mov_rax(i + 1 < pcs.size() ? pcs[i + 1] : pc);
+                a.store_field_rax(offsetof(JitContext, pc));
+                a.store_field(offsetof(JitContext, exit), static_cast<uint32_t>(JitExit::SelfModified));
+                epilogue.push_back(a.jump({ 0xE9 }));
+            }
+        }
+
+        // Epilogue
+        const auto target = a.here();
+        for (const auto p : epilogue) {
+            a.bind(p, target);
+        }
+        a.bytes({ 0x4C, 0x89, 0x73, a.field(offsetof(JitContext, relative_base)) }); // mov [rbx + relative_base], r14
+        a.bytes({ 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3 });   // pop r15-r12, rbx; ret
+
+        if (a.code.size() > ArenaSize) {
+            entry.uncompilable = true;
+            return false;
+        }
+        if (_used + a.code.size() > ArenaSize) {
+            // Out of space, throw everything away and start again
+            for (const auto& r : _ranges) {
+                _entries[r.start] = Entry{};
+            }
+            _ranges.clear();
+            _used = 0;
+        }
+
+        uint8_t* dest = _arena + _used;
+        ::mprotect(_arena, ArenaSize, PROT_READ | PROT_WRITE);
+        std::memcpy(dest, a.code.data(), a.code.size());
+        ::mprotect(_arena, ArenaSize, PROT_READ | PROT_EXEC);
+        _used += (a.code.size() + 15) & ~size_t(15);
+
+        // Mark every word the block was built from
+        for (size_t p = ctx.pc; p < pc; p++) {
+            ctx.code_map[p] |= CodeMapBits::Compiled;
+        }
+
+        entry.code = reinterpret_cast<Block>(dest);
+        _ranges.push_back(Range{ ctx.pc, pc });
+        return true;
+    }
+#endif
+};
+
+};
@@ -0,0 +1,567 @@
+#pragma once
+
+#include "program.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace aoc19 {
+
+/*
+Memoization of pure IntCode subroutines, for Computer::set_memoize().
+
+Subroutines are found from the calling convention CallGraph recovers at run
+time (see profile.h), only statically: a jump to an immediate target
+straight after a store of its return address to [rb+0]. One qualifies if
+every path from its entry
+
+- does no input, output or halt,
+- moves the relative base by immediates only and never below where it
+  started, so every relative operand is a fixed slot of the entry frame,
+- calls only subroutines which qualify, from above its own base,
+- reads a fixed address only straight after writing it (scratch, like a
+  compare result for the jump after it), and
+- gets back to the base it started with and jumps to the return address in
+  slot 0, which it never writes.
+
+What it does then depends only on the slots it reads before writing them,
+its inputs (from liveness over its body, with its callees' inputs at their
+call sites). The first call with some values for those is recorded, every
+word written with its final value, and later calls with the same values
+write those again and return straight away. Frame words are recorded
+relative to the base, so every depth of a recursion shares the results.
+Results are only kept while the code they came from is unchanged, a store
+to any memoized function's code (see code()) drops them all.
+*/
+class Memo
+{
+public:
+    /// Results kept before the table is emptied
+    static constexpr size_t MaxResults = 1 << 20;
+
+    /// Words logged by recordings still going before they are given up
+    static constexpr size_t MaxLog = 1 << 22;
+
+    class Function {
+    public:
+        size_t entry = 0;
+        /// Slots, relative to the base at entry, read before being written
+        std::vector<int64_t> inputs;
+    };
+
+    /// A word written by a recorded call, relative to the base at entry
+    /// unless absolute
+    class Write {
+    public:
+        int64_t address;
+        int64_t value;
+        bool absolute;
+    };
+
+    class Stats {
+    public:
+        /// Calls answered from the table
+        uint64_t hits = 0;
+        /// Calls run and recorded
+        uint64_t misses = 0;
+        /// Recordings kept, the others wrote somewhere they can't be replayed
+        uint64_t recorded = 0;
+        /// Times the table was dropped for a write to code
+        uint64_t flushes = 0;
+    };
+
+    Memo() = default;
+
+    /// A copy has the same results but nothing being recorded
+    Memo(const Memo& other) {
+        *this = other;
+    }
+
+    Memo& operator=(const Memo& other) {
+        if (this != &other) {
+            _enabled = other._enabled;
+            _image_size = other._image_size;
+            _functions = other._functions;
+            _entry_index = other._entry_index;
+            _code = other._code;
+            _scratch = other._scratch;
+            _results = other._results;
+            _stats = other._stats;
+            abandon();
+        }
+        return *this;
+    }
+
+    /// Set AOC_MEMO=1 in the environment to memoize every Computer
+    static bool enabled_by_default() {
+        const char* env = std::getenv("AOC_MEMO");
+        return env && env[0] == '1';
+    }
+
+    bool enabled() const {
+        return _enabled;
+    }
+
+    /// Find the pure subroutines of program, or forget everything
+    void set_enabled(bool v, const Program& program) {
+        _enabled = v;
+        _functions.clear();
+        _entry_index.clear();
+        _code.clear();
+        _scratch.clear();
+        _results.clear();
+        abandon();
+        if (v) {
+            analyse(std::vector<int64_t>(program.begin(), program.end()));
+        }
+    }
+
+    const std::vector<Function>& functions() const {
+        return _functions;
+    }
+
+    /// Addresses of the words of every memoized function's instructions
+    const std::vector<size_t>& code() const {
+        return _code;
+    }
+
+    const Stats& stats() const {
+        return _stats;
+    }
+
+    bool is_entry(size_t pc) const {
+        return pc < _entry_index.size() && _entry_index[pc] != NotEntry;
+    }
+
+    bool recording() const {
+        return !_frames.empty();
+    }
+
+    /// A call of the function at entry pc with base: the writes to replay
+    /// before returning to the address in slot 0, or nullptr if it has to
+    /// run, which is then recorded. get reads memory.
+    template <typename Get>
+    const std::vector<Write>* enter(size_t pc, size_t base, const Get& get) {
+        const auto& f = _functions[_entry_index[pc]];
+        _key.assign(1, static_cast<int64_t>(pc));
+        for (const auto o : f.inputs) {
+            _key.push_back(get(base + o));
+        }
+
+        const auto it = _results.find(_key);
+        if (it != _results.end() && static_cast<int64_t>(base) + it->second.lowest >= static_cast<int64_t>(_image_size)) {
+            _stats.hits++;
+            // Replaying can flush the table, so the writes are copied out
+            _replay = it->second.writes;
+            return &_replay;
+        }
+
+        _stats.misses++;
+        _frames.push_back(Frame{ _key, base, static_cast<size_t>(get(base)), _log.size() });
+        return nullptr;
+    }
+
+    /// Log a store while anything is being recorded
+    void stored(size_t address, int64_t value) {
+        _log.emplace_back(address, value);
+        if (_log.size() > MaxLog) {
+            abandon();
+        }
+    }
+
+    /// Finish every recording the jump to pc with base returns from
+    void returned(size_t pc, size_t base) {
+        while (!_frames.empty() && _frames.back().ret == pc && _frames.back().base == base) {
+            finish();
+        }
+    }
+
+    /// Drop every result, the code changed
+    void flush() {
+        if (!_results.empty() || !_frames.empty()) {
+            _stats.flushes++;
+            _results.clear();
+            abandon();
+        }
+    }
+
+    /// Give up on the recordings still going
+    void abandon() {
+        _frames.clear();
+        _log.clear();
+    }
+
+private:
+    static constexpr uint32_t NotEntry = UINT32_MAX;
+
+    class Frame {
+    public:
+        std::vector<int64_t> key;
+        size_t base;
+        size_t ret;
+        /// First entry of _log written in the call
+        size_t start;
+    };
+
+    class Result {
+    public:
+        std::vector<Write> writes;
+        /// Lowest relative write, the base has to keep it clear of the image
+        int64_t lowest;
+    };
+
+    class KeyHash {
+    public:
+        size_t operator()(const std::vector<int64_t>& key) const {
+            uint64_t h = 0xcbf29ce484222325ull;
+            for (const auto w : key) {
+                h = (h ^ static_cast<uint64_t>(w)) * 0x100000001b3ull;
+                h ^= h >> 29;
+            }
+            return static_cast<size_t>(h);
+        }
+    };
+
+    bool _enabled = false;
+    size_t _image_size = 0;
+    std::vector<Function> _functions;
+    std::vector<uint32_t> _entry_index;
+    std::vector<size_t> _code;
+    /// Fixed addresses the functions write, the only image words a
+    /// recording may change
+    std::set<size_t> _scratch;
+    std::unordered_map<std::vector<int64_t>, Result, KeyHash> _results;
+    Stats _stats;
+
+    std::vector<Frame> _frames;
+    std::vector<std::pair<size_t, int64_t>> _log;
+    std::vector<int64_t> _key;
+    std::vector<Write> _replay;
+
+    void finish() {
+        auto& frame = _frames.back();
+        std::map<size_t, int64_t> last;
+        for (size_t i = frame.start; i < _log.size(); i++) {
+            last[_log[i].first] = _log[i].second;
+        }
+
+        Result result{ {}, 0 };
+        bool keep = true;
+        for (const auto& w : last) {
+            if (w.first < _image_size) {
+                keep = keep && _scratch.count(w.first);
+                result.writes.push_back(Write{ static_cast<int64_t>(w.first), w.second, true });
+            } else {
+                const auto offset = static_cast<int64_t>(w.first - frame.base);
+                result.lowest = std::min(result.lowest, offset);
+                result.writes.push_back(Write{ offset, w.second, false });
+            }
+        }
+        if (keep) {
+            if (_results.size() >= MaxResults) {
+                _results.clear();
+            }
+            _results.emplace(std::move(frame.key), std::move(result));
+            _stats.recorded++;
+        }
+
+        _frames.pop_back();
+        if (_frames.empty()) {
+            _log.clear();
+        }
+    }
+
+    // Static analysis
+
+    class Call {
+    public:
+        size_t pc;
+        size_t callee;
+        int64_t delta;
+    };
+
+    /// A function's body: the base offset at each instruction, from entry
+    class Body {
+    public:
+        bool pure = true;
+        std::map<size_t, int64_t> deltas;
+        std::set<size_t> targets;
+        std::vector<Call> calls;
+        std::set<size_t> writes;
+        std::set<int64_t> inputs;
+    };
+
+    static ImageInstruction decode(const std::vector<int64_t>& image, size_t pc) {
+        return decode_instruction(image.data(), image.size(), pc);
+    }
+
+    /// Whether insn writes the constant value to [rb+0], as a call stores
+    /// its return address
+    static bool stores_return(const ImageInstruction& insn, int64_t value) {
+        if (insn.length != 4 || (insn.opcode != 1 && insn.opcode != 2) || insn.modes[0] != 1 || insn.modes[1] != 1 ||
+                insn.modes[2] != 2 || insn.words[2] != 0) {
+            return false;
+        }
+        const int64_t identity = insn.opcode == 1 ? 0 : 1;
+        return (insn.words[0] == value && insn.words[1] == identity) || (insn.words[1] == value && insn.words[0] == identity);
+    }
+
+    static bool always_jumps(const ImageInstruction& insn) {
+        return insn.modes[0] == 1 && (insn.opcode == 5) == (insn.words[0] != 0);
+    }
+
+    void analyse(const std::vector<int64_t>& image) {
+        _image_size = image.size();
+
+        // Every call site's target, which needn't be a real call if this is
+        // data, but then it just won't be called
+        std::set<size_t> entries;
+        for (size_t pc = 4; pc < image.size(); pc++) {
+            const auto insn = decode(image, pc);
+            if (insn.length && (insn.opcode == 5 || insn.opcode == 6) && insn.modes[1] == 1 && always_jumps(insn) &&
+                    insn.words[1] >= 0 && stores_return(decode(image, pc - 4), pc + 3)) {
+                entries.insert(insn.words[1]);
+            }
+        }
+
+        std::map<size_t, Body> bodies;
+        for (const auto entry : entries) {
+            bodies.emplace(entry, walk(image, entry));
+        }
+
+        // A function is only as pure as everything it calls, and can't write
+        // to any function's code
+        std::set<size_t> code;
+        for (const auto& b : bodies) {
+            for (const auto& d : b.second.deltas) {
+                for (size_t i = 0; i < decode(image, d.first).length; i++) {
+                    code.insert(d.first + i);
+                }
+            }
+        }
+        for (bool changed = true; changed; ) {
+            changed = false;
+            for (auto& b : bodies) {
+                auto& body = b.second;
+                if (!body.pure) {
+                    continue;
+                }
+                for (const auto& call : body.calls) {
+                    const auto callee = bodies.find(call.callee);
+                    body.pure = body.pure && callee != bodies.end() && callee->second.pure;
+                }
+                for (const auto a : body.writes) {
+                    body.pure = body.pure && !code.count(a);
+                }
+                changed = changed || !body.pure;
+            }
+        }
+
+        // Inputs, to a fixed point as functions call each other
+        for (bool changed = true; changed; ) {
+            changed = false;
+            for (auto& b : bodies) {
+                if (b.second.pure) {
+                    auto inputs = get_inputs(image, b.first, b.second, bodies);
+                    if (inputs != b.second.inputs) {
+                        b.second.inputs = std::move(inputs);
+                        changed = true;
+                    }
+                }
+            }
+        }
+
+        _entry_index.assign(image.size(), NotEntry);
+        for (const auto& b : bodies) {
+            if (!b.second.pure) {
+                continue;
+            }
+            _entry_index[b.first] = static_cast<uint32_t>(_functions.size());
+            _functions.push_back(Function{ b.first, { b.second.inputs.begin(), b.second.inputs.end() } });
+            _scratch.insert(b.second.writes.begin(), b.second.writes.end());
+            for (const auto& d : b.second.deltas) {
+                for (size_t i = 0; i < decode(image, d.first).length; i++) {
+                    _code.push_back(d.first + i);
+                }
+            }
+        }
+    }
+
+    /// Every instruction reachable from entry without going into calls,
+    /// with the checks which don't depend on other functions
+    static Body walk(const std::vector<int64_t>& image, size_t entry) {
+        Body body;
+        std::vector<size_t> work;
+        std::vector<std::pair<size_t, int64_t>> reads;
+        const auto visit = [&](int64_t pc, int64_t delta) {
+            if (pc < 0 || static_cast<size_t>(pc) >= image.size() || delta < 0) {
+                body.pure = false;
+                return;
+            }
+            const auto found = body.deltas.emplace(pc, delta);
+            if (found.second) {
+                work.push_back(pc);
+            } else if (found.first->second != delta) {
+                body.pure = false;
+            }
+        };
+
+        visit(entry, 0);
+        while (body.pure && !work.empty()) {
+            const auto pc = work.back(); work.pop_back();
+            const auto delta = body.deltas[pc];
+            const auto insn = decode(image, pc);
+            const auto read = [&](size_t i) {
+                if (insn.modes[i] == 0) {
+                    reads.emplace_back(pc, insn.words[i]);
+                }
+            };
+            switch (insn.length ? insn.opcode : 0) {
+                case 1: case 2: case 7: case 8:
+                    read(0);
+                    read(1);
+                    if (insn.modes[2] == 1 || (insn.modes[2] == 2 && delta + insn.words[2] == 0) ||
+                            (insn.modes[2] == 0 && (insn.words[2] < 0 || static_cast<size_t>(insn.words[2]) >= image.size()))) {
+                        body.pure = false;
+                    } else if (insn.modes[2] == 0) {
+                        body.writes.insert(insn.words[2]);
+                    }
+                    visit(pc + 4, delta);
+                    break;
+                case 9:
+                    body.pure = insn.modes[0] == 1;
+                    visit(pc + 2, delta + insn.words[0]);
+                    break;
+                case 5: case 6: {
+                    read(0);
+                    const bool always = always_jumps(insn);
+                    const bool never = insn.modes[0] == 1 && !always;
+                    if (insn.modes[1] == 2) {
+                        // Only the return
+                        body.pure = always && delta == 0 && insn.words[1] == 0;
+                    } else if (insn.modes[1] == 0) {
+                        body.pure = false;
+                    } else if (always && pc >= 4 && stores_return(decode(image, pc - 4), pc + 3)) {
+                        body.pure = delta > 0 && insn.words[1] >= 0;
+                        body.calls.push_back(Call{ pc, static_cast<size_t>(insn.words[1]), delta });
+                        body.targets.insert(pc + 3);
+                        visit(pc + 3, delta);
+                    } else {
+                        if (!never) {
+                            body.targets.insert(insn.words[1]);
+                            visit(insn.words[1], delta);
+                        }
+                        if (!always) {
+                            visit(pc + 3, delta);
+                        }
+                    }
+                    break;
+                }
+                default: // input, output, halt or not an instruction
+                    body.pure = false;
+                    break;
+            }
+        }
+
+        // A call has to be entered through its store of the return address
+        for (const auto& call : body.calls) {
+            body.pure = body.pure && call.pc != entry && body.deltas.count(call.pc - 4) && !body.targets.count(call.pc);
+        }
+        // and a fixed address read only just after the instruction before
+        // it, which nothing else gets to, wrote it
+        for (const auto& r : reads) {
+            const auto pc = r.first;
+            bool written = false;
+            size_t predecessors = 0;
+            for (size_t p = pc >= 4 ? pc - 4 : 0; p < pc; p++) {
+                if (!body.deltas.count(p)) {
+                    continue;
+                }
+                const auto insn = decode(image, p);
+                if (p + insn.length == pc) {
+                    predecessors++;
+                    written = insn.length == 4 && insn.opcode != 5 && insn.opcode != 6 &&
+                        insn.modes[2] == 0 && insn.words[2] == r.second;
+                }
+            }
+            body.pure = body.pure && written && predecessors == 1 && pc != entry && !body.targets.count(pc);
+        }
+        return body;
+    }
+
+    /// Slots read before being written on some path from entry
+    static std::set<int64_t> get_inputs(const std::vector<int64_t>& image, size_t entry, const Body& body,
+            const std::map<size_t, Body>& bodies) {
+        std::map<size_t, const Call*> calls;
+        for (const auto& call : body.calls) {
+            calls[call.pc] = &call;
+        }
+
+        std::map<size_t, std::set<int64_t>> live;
+        for (bool changed = true; changed; ) {
+            changed = false;
+            for (auto it = body.deltas.rbegin(); it != body.deltas.rend(); ++it) {
+                const auto pc = it->first;
+                const auto delta = it->second;
+                const auto insn = decode(image, pc);
+
+                std::set<int64_t> in;
+                const auto flow = [&](size_t next) {
+                    const auto found = live.find(next);
+                    if (found != live.end()) {
+                        in.insert(found->second.begin(), found->second.end());
+                    }
+                };
+                const auto use = [&](size_t i) {
+                    if (insn.modes[i] == 2) {
+                        in.insert(delta + insn.words[i]);
+                    }
+                };
+
+                const auto call = calls.find(pc);
+                if (call != calls.end()) {
+                    flow(pc + 3);
+                    for (const auto o : bodies.at(call->second->callee).inputs) {
+                        in.insert(delta + o);
+                    }
+                } else if (insn.opcode == 5 || insn.opcode == 6) {
+                    if (insn.modes[1] == 1) {
+                        if (!(insn.modes[0] == 1 && !always_jumps(insn))) {
+                            flow(insn.words[1]);
+                        }
+                        if (!always_jumps(insn)) {
+                            flow(pc + 3);
+                        }
+                    }
+                    // The return reads slot 0 but that is where it goes, not
+                    // what it does
+                    use(0);
+                } else if (insn.opcode == 9) {
+                    flow(pc + 2);
+                } else {
+                    flow(pc + 4);
+                    if (insn.modes[2] == 2) {
+                        in.erase(delta + insn.words[2]);
+                    }
+                    use(0);
+                    use(1);
+                }
+
+                auto& slot = live[pc];
+                if (in != slot) {
+                    slot = std::move(in);
+                    changed = true;
+                }
+            }
+        }
+        return live[entry];
+    }
+};
+
+};
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+
+namespace aoc19 {
+
+/*
+Sparse IntCode memory, in 4 KiB pages found through a hash of the page
+number. Pages are only allocated when written, anything else reads from one
+shared page of zeros, so a single store to a huge address costs one page.
+
+Copies share their pages, a page is only copied once it is written while
+another copy still holds it.
+*/
+class PagedMemory
+{
+public:
+    static constexpr size_t PageWords = 512;
+
+    using Page = std::array<int64_t, PageWords>;
+
+    bool empty() const {
+        return _pages.empty();
+    }
+
+    /// Number of pages allocated
+    size_t size() const {
+        return _pages.size();
+    }
+
+    void clear() {
+        _pages.clear();
+    }
+
+    int64_t get(size_t address) const {
+        return page(address / PageWords)[address % PageWords];
+    }
+
+    void set(size_t address, int64_t value) {
+        auto& p = _pages[address / PageWords];
+        if (!p) {
+            p = std::make_shared<Page>(ZeroPage);
+        }
+        writable(p)[address % PageWords] = value;
+    }
+
+    /// Call f(address, value) for every nonzero word
+    template <typename F>
+    void for_each(F f) const {
+        for (const auto& p : _pages) {
+            const auto& words = *p.second;
+            for (size_t i = 0; i < PageWords; i++) {
+                if (words[i]) {
+                    f(p.first * PageWords + i, words[i]);
+                }
+            }
+        }
+    }
+
+    /// Move [begin, end) out to dest, dropping any page left with nothing
+    /// outside of that range
+    void drain(size_t begin, size_t end, int64_t* dest) {
+        for (auto it = _pages.begin(); it != _pages.end(); ) {
+            const size_t first = it->first * PageWords;
+            const size_t last = first + PageWords;
+            if (last <= begin || first >= end) {
+                ++it;
+                continue;
+            }
+
+            auto& words = writable(it->second);
+            for (size_t a = std::max(first, begin); a < std::min(last, end); a++) {
+                dest[a - begin] = words[a - first];
+                words[a - first] = 0;
+            }
+
+            if (words == ZeroPage) {
+                it = _pages.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+private:
+    static inline const Page ZeroPage{};
+
+    std::unordered_map<size_t, std::shared_ptr<Page>> _pages;
+
+    static Page& writable(std::shared_ptr<Page>& p) {
+        if (p.use_count() > 1) {
+            p = std::make_shared<Page>(*p);
+        }
+        return *p;
+    }
+
+    const Page& page(size_t number) const {
+        if (_pages.empty()) {
+            return ZeroPage;
+        }
+        const auto it = _pages.find(number);
+        return it == _pages.end() ? ZeroPage : *it->second;
+    }
+};
+
+};
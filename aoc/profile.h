@@ -0,0 +1,490 @@
+#pragma once
+
+#include "program.h"
+
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace aoc19 {
+
+/*
+Functions recovered from the way compiled IntCode calls them: the caller
+writes the address after its jump into the callee's frame, at the relative
+base, and jumps; the callee moves the relative base up over its frame, and
+on the way out moves it back down and jumps to whatever the frame's first
+word holds.
+
+So a call is a direct jump straight after a store of that jump's return
+address, or straight after the relative base was moved up, and a return is
+an indirect jump (the target read from memory) to a return address on the
+shadow stack, which is popped down to that frame. Every instruction is
+charged to the frame on top of the stack, and the calling context tree keeps
+those counts per distinct stack, for folded flamegraph output.
+*/
+class CallGraph
+{
+public:
+    /// Entry of the outermost frame, which no call made
+    static constexpr size_t Root = SIZE_MAX;
+
+    /// Calls deeper than this are charged to the frame they came from
+    static constexpr size_t MaxDepth = 1 << 16;
+
+    class Function {
+    public:
+        size_t entry = Root;
+        uint64_t calls = 0;
+        /// Instructions run in the function and everything it called, each
+        /// counted once however deep the recursion
+        uint64_t inclusive = 0;
+        /// Instructions run in the function itself
+        uint64_t exclusive = 0;
+    };
+
+    CallGraph() {
+        clear();
+    }
+
+    void clear() {
+        _nodes.assign(1, Node{ Root, 0, 0, 0 });
+        _children.clear();
+        _functions.clear();
+        _functions[Root].active = 1;
+        _stack.clear();
+        _current = 0;
+        _total = 0;
+        _previous = _pending = Recent{};
+    }
+
+    void instruction() {
+        _nodes[_current].exclusive++;
+        _total++;
+        _previous = _pending;
+        _pending = Recent{};
+    }
+
+    /// Take back the last instruction(), which stalled and will be counted
+    /// again when it runs
+    void stalled() {
+        _nodes[_current].exclusive--;
+        _total--;
+        _pending = _previous;
+    }
+
+    void stored(int64_t value) {
+        _pending.stored = true;
+        _pending.value = value;
+    }
+
+    void adjusted(int64_t delta) {
+        _pending.grew_frame |= delta > 0;
+    }
+
+    /// A taken jump from pc to target, indirect if target came from memory
+    void jumped(size_t pc, size_t target, bool indirect) {
+        const auto return_pc = pc + 3;
+        if (!indirect) {
+            const bool linked = _previous.stored && _previous.value == static_cast<int64_t>(return_pc);
+            if ((linked || _previous.grew_frame) && _stack.size() < MaxDepth) {
+                call(target, return_pc);
+            }
+            return;
+        }
+
+        for (size_t i = _stack.size(); i-- > 0;) {
+            if (_stack[i].return_pc == target) {
+                while (_stack.size() > i) {
+                    ret();
+                }
+                return;
+            }
+        }
+    }
+
+    /// Depth of the shadow stack, 0 outside of any call
+    size_t depth() const {
+        return _stack.size();
+    }
+
+    /// Every function seen, outermost first then by entry, counting frames
+    /// still open as if they returned now
+    std::vector<Function> get_functions() const {
+        std::map<size_t, Function> functions;
+        for (const auto& [entry, stats] : _functions) {
+            auto& f = functions[entry];
+            f.entry = entry;
+            f.calls = stats.calls;
+            f.inclusive = stats.inclusive;
+        }
+        functions[Root].inclusive = _total;
+        for (const auto& frame : _stack) {
+            if (frame.outermost) {
+                functions[_nodes[frame.node].function].inclusive += _total - frame.entered;
+            }
+        }
+        for (const auto& node : _nodes) {
+            functions[node.function].exclusive += node.exclusive;
+        }
+
+        std::vector<Function> result;
+        result.push_back(functions[Root]);
+        for (const auto& [entry, f] : functions) {
+            if (entry != Root) {
+                result.push_back(f);
+            }
+        }
+        return result;
+    }
+
+    /// Calls made from one function to another, (caller, callee) -> count
+    std::map<std::pair<size_t, size_t>, uint64_t> get_edges() const {
+        std::map<std::pair<size_t, size_t>, uint64_t> edges;
+        for (size_t n = 1; n < _nodes.size(); n++) {
+            edges[{ _nodes[_nodes[n].parent].function, _nodes[n].function }] += _nodes[n].calls;
+        }
+        return edges;
+    }
+
+    static std::string get_name(size_t entry) {
+        return entry == Root ? "main" : "fn_" + std::to_string(entry);
+    }
+
+    void write_json(std::ostream& os) const {
+        os << "{\n    \"functions\": [";
+        bool first = true;
+        for (const auto& f : get_functions()) {
+            os << (first ? "\n" : ",\n") << "      { \"name\": \"" << get_name(f.entry) << "\"";
+            if (f.entry != Root) {
+                os << ", \"entry\": " << f.entry;
+            }
+            os << ", \"calls\": " << f.calls << ", \"inclusive\": " << f.inclusive << ", \"exclusive\": " << f.exclusive << " }";
+            first = false;
+        }
+        os << "\n    ],\n    \"edges\": [";
+        first = true;
+        for (const auto& [edge, count] : get_edges()) {
+            os << (first ? "\n" : ",\n") << "      { \"caller\": \"" << get_name(edge.first)
+                << "\", \"callee\": \"" << get_name(edge.second) << "\", \"calls\": " << count << " }";
+            first = false;
+        }
+        os << "\n    ]\n  }";
+    }
+
+    /// Flamegraph folded stacks, one root;main;fn_a;fn_b count line per
+    /// distinct call stack
+    void write_folded(std::ostream& os, const std::string& root) const {
+        std::vector<std::string> paths(_nodes.size());
+        for (size_t n = 0; n < _nodes.size(); n++) {
+            // Parents are always created before their children
+            paths[n] = (n ? paths[_nodes[n].parent] : root) + ";" + get_name(_nodes[n].function);
+            if (_nodes[n].exclusive) {
+                os << paths[n] << " " << _nodes[n].exclusive << "\n";
+            }
+        }
+    }
+
+private:
+    /// One distinct call stack in the calling context tree
+    class Node {
+    public:
+        size_t function;
+        size_t parent;
+        uint64_t calls;
+        uint64_t exclusive;
+    };
+
+    class Frame {
+    public:
+        size_t node;
+        size_t return_pc;
+        /// _total when the call was made
+        uint64_t entered;
+        /// No other frame of the same function is further down the stack
+        bool outermost;
+    };
+
+    class Stats {
+    public:
+        uint64_t calls = 0;
+        uint64_t inclusive = 0;
+        /// Frames of the function on the stack
+        size_t active = 0;
+    };
+
+    /// What the last instruction did which could be part of a call
+    class Recent {
+    public:
+        bool stored = false;
+        int64_t value = 0;
+        bool grew_frame = false;
+    };
+
+    std::vector<Node> _nodes;
+    /// (parent node, function) -> child node
+    std::map<std::pair<size_t, size_t>, size_t> _children;
+    std::map<size_t, Stats> _functions;
+    std::vector<Frame> _stack;
+    size_t _current;
+    uint64_t _total;
+    Recent _previous;
+    Recent _pending;
+
+    void call(size_t entry, size_t return_pc) {
+        const auto [it, added] = _children.try_emplace({ _current, entry }, _nodes.size());
+        if (added) {
+            _nodes.push_back(Node{ entry, _current, 0, 0 });
+        }
+        const auto node = it->second;
+        _nodes[node].calls++;
+
+        auto& stats = _functions[entry];
+        stats.calls++;
+        _stack.push_back(Frame{ node, return_pc, _total, stats.active++ == 0 });
+        _current = node;
+    }
+
+    void ret() {
+        const auto frame = _stack.back();
+        _stack.pop_back();
+        auto& stats = _functions[_nodes[frame.node].function];
+        stats.active--;
+        if (frame.outermost) {
+            stats.inclusive += _total - frame.entered;
+        }
+        _current = _nodes[frame.node].parent;
+    }
+};
+
+/*
+Execution counts gathered by a Computer built with AOC_PROFILE (the CMake
+option of the same name). Without it nothing is counted and the hooks
+compile away.
+
+Instructions are counted per pc and per instruction word, the opcode plus
+its mode digits, from which the per opcode and per addressing mode totals
+are worked out. Conditional jumps also count how often they were taken,
+and calls and returns are followed to count instructions per function, see
+CallGraph.
+*/
+class Profile
+{
+public:
+    /// One past the largest instruction word counted on its own, the rest
+    /// share the last slot
+    static constexpr int64_t MaxWord = 22300;
+
+    /// Mnemonic for an opcode, as in the opcode list in computer.h
+    static const char* mnemonic(int64_t opcode) {
+        switch (opcode) {
+            case 1: return "ADD";
+            case 2: return "MUL";
+            case 3: return "IN";
+            case 4: return "OUT";
+            case 5: return "JNZ";
+            case 6: return "JZ";
+            case 7: return "SLT";
+            case 8: return "SEQ";
+            case 9: return "ARB";
+            case 99: return "HALT";
+        }
+        return "???";
+    }
+
+    /// Pcs below size are counted in place, any others (a jump far out of
+    /// the program) one by one, so they don't allocate everything between
+    void set_program_size(size_t size) {
+        _pcs.assign(size, PcCounts{});
+        _far.clear();
+    }
+
+    void instruction(size_t pc, int64_t raw) {
+        auto& counts = at(pc);
+        counts.executed++;
+        counts.opcode = static_cast<uint8_t>(raw >= 0 ? raw % 100 : 0);
+        _words[raw >= 0 && raw < MaxWord ? raw : MaxWord]++;
+        _total++;
+        _calls.instruction();
+    }
+
+    /// Take back the count of the instruction at pc, an IN with no input or
+    /// an OUT which couldn't write, so it is counted once when it runs again
+    void stalled(size_t pc, int64_t raw) {
+        auto& counts = at(pc);
+        counts.executed--;
+        _words[raw >= 0 && raw < MaxWord ? raw : MaxWord]--;
+        _total--;
+        _calls.stalled();
+    }
+
+    void branch(size_t pc, bool taken) {
+        auto& counts = at(pc);
+        if (taken) {
+            counts.taken++;
+        } else {
+            counts.not_taken++;
+        }
+    }
+
+    /// Memory written by the instruction being executed
+    void stored(int64_t value) {
+        _calls.stored(value);
+    }
+
+    /// Relative base moved by delta
+    void adjusted(int64_t delta) {
+        _calls.adjusted(delta);
+    }
+
+    /// A jump from pc to target was taken, indirect if target was read from
+    /// memory rather than immediate
+    void jumped(size_t pc, size_t target, bool indirect) {
+        _calls.jumped(pc, target, indirect);
+    }
+
+    const CallGraph& calls() const {
+        return _calls;
+    }
+
+    void clear() {
+        _calls.clear();
+        _pcs.assign(_pcs.size(), PcCounts{});
+        _far.clear();
+        _words.assign(MaxWord + 1, 0);
+        _total = 0;
+    }
+
+    uint64_t total() const {
+        return _total;
+    }
+
+    uint64_t executed(size_t pc) const {
+        if (pc < _pcs.size()) {
+            return _pcs[pc].executed;
+        }
+        const auto it = _far.find(pc);
+        return it != _far.end() ? it->second.executed : 0;
+    }
+
+    /// Executions of each opcode, indexed by opcode
+    std::vector<uint64_t> get_opcode_counts() const {
+        std::vector<uint64_t> counts(100, 0);
+        for (int64_t w = 0; w < MaxWord; w++) {
+            counts[w % 100] += _words[w];
+        }
+        return counts;
+    }
+
+    /// Operands read or written in each mode, position, immediate, relative
+    std::vector<uint64_t> get_mode_counts() const {
+        std::vector<uint64_t> counts(3, 0);
+        for (int64_t w = 0; w < MaxWord; w++) {
+            if (!_words[w]) {
+                continue;
+            }
+            auto modes = w / 100;
+            for (size_t i = 0; i < parameter_count(w % 100); i++) {
+                const auto mode = modes % 10;
+                if (mode < 3) {
+                    counts[mode] += _words[w];
+                }
+                modes /= 10;
+            }
+        }
+        return counts;
+    }
+
+    void write_json(std::ostream& os) const {
+        static const char* const Modes[] = { "position", "immediate", "relative" };
+
+        os << "{\n  \"instructions\": " << _total << ",\n  \"opcodes\": {";
+        const auto opcodes = get_opcode_counts();
+        bool first = true;
+        for (size_t op = 0; op < opcodes.size(); op++) {
+            if (opcodes[op]) {
+                os << (first ? "\n" : ",\n") << "    \"" << mnemonic(op) << "\": " << opcodes[op];
+                first = false;
+            }
+        }
+
+        os << "\n  },\n  \"modes\": {";
+        const auto modes = get_mode_counts();
+        for (size_t m = 0; m < modes.size(); m++) {
+            os << (m ? ",\n" : "\n") << "    \"" << Modes[m] << "\": " << modes[m];
+        }
+
+        os << "\n  },\n  \"words\": {";
+        first = true;
+        for (int64_t w = 0; w <= MaxWord; w++) {
+            if (_words[w]) {
+                os << (first ? "\n" : ",\n") << "    \"" << (w == MaxWord ? std::string("other") : std::to_string(w)) << "\": " << _words[w];
+                first = false;
+            }
+        }
+
+        os << "\n  },\n  \"pcs\": [";
+        first = true;
+        for_each_pc([&os, &first](size_t pc, const PcCounts& c) {
+            os << (first ? "\n" : ",\n") << "    { \"pc\": " << pc << ", \"opcode\": \"" << mnemonic(c.opcode)
+                << "\", \"executed\": " << c.executed;
+            if (c.taken || c.not_taken) {
+                os << ", \"taken\": " << c.taken << ", \"not_taken\": " << c.not_taken;
+            }
+            os << " }";
+            first = false;
+        });
+        os << "\n  ],\n  \"calls\": ";
+        _calls.write_json(os);
+        os << "\n}\n";
+    }
+
+    /// Flamegraph folded stacks, one root;opcode;pc count line per pc, for
+    /// flamegraph.pl and the like
+    void write_folded(std::ostream& os, const std::string& root = "intcode") const {
+        for_each_pc([&os, &root](size_t pc, const PcCounts& c) {
+            os << root << ";" << mnemonic(c.opcode) << ";pc_" << pc << " " << c.executed << "\n";
+        });
+    }
+
+private:
+    class PcCounts {
+    public:
+        uint64_t executed = 0;
+        uint64_t taken = 0;
+        uint64_t not_taken = 0;
+        /// Opcode last executed at this pc
+        uint8_t opcode = 0;
+    };
+
+    PcCounts& at(size_t pc) {
+        return pc < _pcs.size() ? _pcs[pc] : _far[pc];
+    }
+
+    /// f(pc, counts) for every pc executed, in order
+    template <typename F>
+    void for_each_pc(F f) const {
+        for (size_t pc = 0; pc < _pcs.size(); pc++) {
+            if (_pcs[pc].executed) {
+                f(pc, _pcs[pc]);
+            }
+        }
+        for (const auto& p : _far) {
+            if (p.second.executed) {
+                f(p.first, p.second);
+            }
+        }
+    }
+
+    /// Counts for the program's pcs, see set_program_size()
+    std::vector<PcCounts> _pcs;
+    /// and for anything run beyond it
+    std::map<size_t, PcCounts> _far;
+    CallGraph _calls;
+    std::vector<uint64_t> _words = std::vector<uint64_t>(MaxWord + 1, 0);
+    uint64_t _total = 0;
+};
+
+};
@@ -0,0 +1,281 @@
+#pragma once
+
+#include "helpers.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define AOC_HAS_MMAP 1
+#else
+#define AOC_HAS_MMAP 0
+#endif
+
+namespace aoc19 {
+
+    using Memory = std::vector<int64_t>;
+
+    /// The value of the bytes at p read little endian, the way the binary
+    /// programs, traces and checkpoints store their words
+    inline uint64_t read_le(const uint8_t* p, size_t bytes) {
+        uint64_t v = 0;
+        for (size_t i = 0; i < bytes; i++) {
+            v |= static_cast<uint64_t>(p[i]) << (8 * i);
+        }
+        return v;
+    }
+
+    /// Write the low bytes of v to os little endian
+    inline void write_le(std::ostream& os, uint64_t v, size_t bytes) {
+        for (size_t i = 0; i < bytes; i++) {
+            os.put(static_cast<char>((v >> (8 * i)) & 0xFF));
+        }
+    }
+
+    /// Number of parameters taken by opcode, 0 for a halt or anything
+    /// which isn't an opcode
+    inline size_t parameter_count(int64_t opcode) {
+        switch (opcode) {
+            case 1: case 2: case 7: case 8:
+                return 3;
+            case 5: case 6:
+                return 2;
+            case 3: case 4: case 9:
+                return 1;
+        }
+        return 0;
+    }
+
+    /// An instruction as it stands in a program image, for the static
+    /// analyses which look at code without running it
+    class ImageInstruction {
+    public:
+        int64_t opcode = 0;
+        int64_t modes[3] = { 0, 0, 0 };
+        int64_t words[3] = { 0, 0, 0 };
+        size_t length = 0; // 0 == not decodable
+    };
+
+    /// Decode the instruction at pc of the size words at image, length is 0
+    /// if it is invalid or runs off the end
+    inline ImageInstruction decode_instruction(const int64_t* image, size_t size, size_t pc) {
+        ImageInstruction insn;
+        const auto raw = pc < size ? image[pc] : -1;
+        if (raw < 0) {
+            return insn;
+        }
+
+        insn.opcode = raw % 100;
+        const auto count = parameter_count(insn.opcode);
+        if ((!count && insn.opcode != 99) || pc + count >= size) {
+            return insn;
+        }
+
+        auto modes = raw / 100;
+        for (size_t i = 0; i < count; i++) {
+            insn.modes[i] = modes % 10;
+            insn.words[i] = image[pc + i + 1];
+            modes /= 10;
+            if (insn.modes[i] > 2) {
+                return insn;
+            }
+        }
+        insn.length = count + 1;
+        return insn;
+    }
+
+/*
+A parsed IntCode program image. Immutable, so every copy (and every Computer
+built from it) shares the one image.
+
+Program::load() parses each distinct program text once per process, which
+is what the Computer(std::string) constructors use.
+
+Programs can also be saved in a binary form which Program::map() maps
+straight into memory read only, so loading costs the same whatever the
+size of the program and processes running it share the pages:
+
+    offset  size
+         0     8  magic "AOC19IC\0"
+         8     4  version (1)
+        12     4  flags (0, reserved)
+        16     8  offset of the image from the start of the file
+        24     8  number of words in the image
+    offset  8 * n image, int64 little endian
+*/
+class Program
+{
+public:
+    static constexpr char BinaryMagic[8] = { 'A', 'O', 'C', '1', '9', 'I', 'C', '\0' };
+    static constexpr uint32_t BinaryVersion = 1;
+    static constexpr uint64_t BinaryHeaderSize = 32;
+
+    Program()
+        : Program(Memory{})
+    {
+    }
+
+    explicit Program(Memory image) {
+        const auto owner = std::make_shared<const Memory>(std::move(image));
+        _words = std::shared_ptr<const int64_t>(owner, owner->data());
+        _size = owner->size();
+    }
+
+    /// Parse text, without looking in the cache
+    static Program parse(const std::string& text) {
+        Memory image;
+        aoc::parse_as_integers(text, ',', [&](const auto t) { image.push_back(t); });
+        return Program(std::move(image));
+    }
+
+    /// The program for text, parsed the first time it is asked for
+    static Program load(const std::string& text) {
+        static std::mutex lock;
+        static std::unordered_map<std::string, Program> cache;
+
+        std::lock_guard<std::mutex> guard(lock);
+        const auto found = cache.find(text);
+        if (found != cache.end()) {
+            return found->second;
+        }
+        return cache.emplace(text, parse(text)).first->second;
+    }
+
+    /// Whether the file at path starts like a binary program
+    static bool is_binary(const std::string& path) {
+        std::ifstream f(path, std::ios::binary);
+        char magic[sizeof(BinaryMagic)] = {};
+        f.read(magic, sizeof(magic));
+        return f.good() && ::memcmp(magic, BinaryMagic, sizeof(magic)) == 0;
+    }
+
+    /// Load a program from a binary file written by save()
+    static Program map(const std::string& path) {
+#if AOC_HAS_MMAP
+        if (is_little_endian()) {
+            const int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                throw std::runtime_error("Unable to open " + path);
+            }
+            struct stat st;
+            const bool sized = ::fstat(fd, &st) == 0;
+            const size_t length = sized ? static_cast<size_t>(st.st_size) : 0;
+            void* base = length ? ::mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+            ::close(fd);
+            if (base == MAP_FAILED) {
+                throw std::runtime_error("Unable to map " + path);
+            }
+
+            const std::shared_ptr<const void> mapping(base, [length](const void* p) {
+                ::munmap(const_cast<void*>(p), length);
+            });
+            const auto bytes = static_cast<const uint8_t*>(base);
+            const auto header = read_header(bytes, length, path);
+
+            Program p;
+            p._words = std::shared_ptr<const int64_t>(mapping, reinterpret_cast<const int64_t*>(bytes + header.first));
+            p._size = header.second;
+            return p;
+        }
+#endif
+        // No mmap, or the words need swapping, read it in instead
+        std::ifstream f(path, std::ios::binary);
+        const std::vector<uint8_t> bytes((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+        const auto header = read_header(bytes.data(), bytes.size(), path);
+
+        Memory image(header.second);
+        for (size_t i = 0; i < image.size(); i++) {
+            image[i] = static_cast<int64_t>(read_le(bytes.data() + header.first + i * 8, 8));
+        }
+        return Program(std::move(image));
+    }
+
+    /// Write the binary form of the program to path
+    void save(const std::string& path) const {
+        std::ofstream f(path, std::ios::binary | std::ios::trunc);
+        f.write(BinaryMagic, sizeof(BinaryMagic));
+        write_le(f, BinaryVersion, 4);
+        write_le(f, 0, 4);
+        write_le(f, BinaryHeaderSize, 8);
+        write_le(f, _size, 8);
+        for (size_t i = 0; i < _size; i++) {
+            write_le(f, static_cast<uint64_t>(_words.get()[i]), 8);
+        }
+        if (!f.good()) {
+            throw std::runtime_error("Unable to write " + path);
+        }
+    }
+
+    const int64_t* data() const {
+        return _words.get();
+    }
+
+    size_t size() const {
+        return _size;
+    }
+
+    const int64_t* begin() const {
+        return _words.get();
+    }
+
+    const int64_t* end() const {
+        return _words.get() + _size;
+    }
+
+    int64_t operator[](size_t address) const {
+        return _words.get()[address];
+    }
+
+    bool operator==(const Program& other) const {
+        return _size == other._size &&
+            (_words == other._words || std::equal(begin(), end(), other.begin()));
+    }
+
+    bool operator!=(const Program& other) const {
+        return !(*this == other);
+    }
+
+    /// Whether int64 words are laid out as in the binary form, so they can
+    /// be mapped as they are
+    static bool is_little_endian() {
+        const uint16_t probe = 1;
+        uint8_t first;
+        ::memcpy(&first, &probe, 1);
+        return first == 1;
+    }
+
+private:
+    /// Points into whatever owns the words, a Memory or a mapped file
+    std::shared_ptr<const int64_t> _words;
+    size_t _size = 0;
+
+    /// Check the header of a binary program, returning the offset and
+    /// number of words of its image
+    static std::pair<uint64_t, uint64_t> read_header(const uint8_t* bytes, size_t length, const std::string& path) {
+        if (length < BinaryHeaderSize || ::memcmp(bytes, BinaryMagic, sizeof(BinaryMagic)) != 0) {
+            throw std::runtime_error(path + " is not an IntCode binary");
+        }
+        if (read_le(bytes + 8, 4) != BinaryVersion) {
+            throw std::runtime_error(path + " is an unsupported IntCode binary version");
+        }
+        const auto offset = read_le(bytes + 16, 8);
+        const auto words = read_le(bytes + 24, 8);
+        if (offset % 8 || offset < BinaryHeaderSize || offset > length || words > (length - offset) / 8) {
+            throw std::runtime_error(path + " is truncated");
+        }
+        return { offset, words };
+    }
+};
+
+};
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "computer.h"
+#include "trace.h"
+
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+namespace aoc19 {
+
+/// How far a replay got
+class ReplayResult {
+public:
+    /// Records of the trace reproduced
+    size_t records = 0;
+    size_t inputs = 0;
+    size_t outputs = 0;
+    size_t branches = 0;
+    bool diverged = false;
+    /// What differed, if it diverged at records
+    std::string message;
+};
+
+/*
+Runs c through a trace in place of the driver which recorded it: it does the
+same initialize() and set_memory() calls, gives the program each recorded
+input when it gets to reading it, and checks that it produces the same
+outputs and, if they were recorded, takes the same branches. Stops at the
+first difference, or at the end of the trace, with c where the trace left
+it.
+
+c must be built from the program the trace was recorded from. It is left
+pausing on every output.
+*/
+inline ReplayResult replay(const Trace& trace, Computer& c) {
+    if (!trace.matches(c.program())) {
+        throw std::runtime_error("Trace was recorded from a different program");
+    }
+
+    const auto previous = c.trace();
+    const auto recorder = std::make_shared<TraceRecorder>(c.program(), trace.branches());
+    c.set_trace(recorder);
+    c.set_run_to_completion(false);
+
+    const auto& expected = trace.records();
+    ReplayResult result;
+    // Index of the input record already queued
+    size_t fed = SIZE_MAX;
+    InputOutputs outputs;
+
+    while (result.records < expected.size() && !result.diverged) {
+        const auto& next = expected[result.records];
+        const auto before = result.records;
+        HaltCode code = HaltCode::HasOutput;
+        switch (next.event) {
+            case TraceEvent::Reset:
+                c.initialize();
+                break;
+            case TraceEvent::Patch:
+                c.set_memory(next.address, next.value);
+                break;
+            default:
+                if (next.event == TraceEvent::Input && fed != result.records) {
+                    c.set_input(next.value);
+                    fed = result.records;
+                }
+                code = c.run(outputs);
+                while (!outputs.empty()) {
+                    outputs.pop();
+                }
+                break;
+        }
+
+        for (const auto& r : recorder->drain()) {
+            if (result.records == expected.size()) {
+                break;
+            }
+            if (r != expected[result.records]) {
+                std::stringstream ss;
+                ss << "expected " << expected[result.records] << ", got " << r;
+                result.message = ss.str();
+                result.diverged = true;
+                break;
+            }
+            result.inputs += r.event == TraceEvent::Input;
+            result.outputs += r.event == TraceEvent::Output;
+            result.branches += r.event == TraceEvent::Branch;
+            result.records++;
+        }
+
+        if (!result.diverged && result.records == before) {
+            std::stringstream ss;
+            ss << "expected " << next << ", got " << (code == HaltCode::Halt ? "halt" :
+                code == HaltCode::NeedsInput ? "a read with no input" : "nothing");
+            result.message = ss.str();
+            result.diverged = true;
+        }
+    }
+
+    c.set_trace(previous);
+    return result;
+}
+
+};
@@ -0,0 +1,320 @@
+#pragma once
+
+#include "computer.h"
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace aoc19 {
+
+/// What a Scheduler::run() did
+class SchedulerStats {
+public:
+    double seconds = 0;
+    /// Fraction of the workers' time spent running VMs
+    double utilisation = 0;
+    uint64_t instructions = 0;
+    /// Times a VM was given a quantum
+    uint64_t slices = 0;
+    /// Times a worker took a VM from another worker's queue
+    uint64_t steals = 0;
+};
+
+/*
+Runs many Computers on a pool of worker threads, each VM getting at most a
+quantum of instructions at a time before going to the back of the queue.
+
+Every worker has its own deque of runnable VMs, taking from the front of its
+own and, when that is empty, stealing from the back of the others'. A VM
+which needs input is parked until send() gives it some, and one that halts
+is done. run() returns once nothing is left runnable.
+
+Outputs go to the output handler, called on the worker thread straight after
+the VM's quantum, which may send() to any VM. Without a handler they are kept
+for outputs().
+*/
+class Scheduler
+{
+public:
+    using Id = size_t;
+    using OutputHandler = std::function<void(Id, int64_t)>;
+
+    static constexpr uint64_t DefaultQuantum = 10000;
+
+    explicit Scheduler(size_t threads = std::thread::hardware_concurrency(), uint64_t quantum = DefaultQuantum)
+        : _threads(std::max<size_t>(threads, 1))
+        , _quantum(quantum)
+        , _queues(_threads)
+    {
+    }
+
+    /// Add a VM, runnable from the next run()
+    Id add(Computer vm) {
+        const Id id = _tasks.size();
+        _tasks.push_back(std::make_unique<Task>(std::move(vm)));
+        _tasks.back()->state = State::Runnable;
+        _queues[id % _threads].push(id);
+        _runnable++;
+        return id;
+    }
+
+    void set_output_handler(OutputHandler handler) {
+        _handler = std::move(handler);
+    }
+
+    /// Queue input for a VM, waking it if it was parked. Safe from the
+    /// output handler.
+    void send(Id id, int64_t value) {
+        auto& task = *_tasks[id];
+        std::lock_guard<std::mutex> guard(task.lock);
+        task.inbox.push(value);
+        if (task.state == State::Parked) {
+            task.state = State::Runnable;
+            _runnable++;
+            _queues[_scheduler == this ? _worker : id % _threads].push(id);
+        }
+    }
+
+    /// Run until every VM has halted or is waiting for input nobody sends
+    SchedulerStats run() {
+        const auto start = std::chrono::steady_clock::now();
+        std::vector<uint64_t> busy(_threads, 0);
+        _steals = 0;
+        _slices = 0;
+        _failed = false;
+        uint64_t before = 0;
+        for (const auto& t : _tasks) {
+            before += t->instructions;
+        }
+
+        std::vector<std::thread> workers;
+        for (size_t w = 1; w < _threads; w++) {
+            workers.emplace_back([this, w, &busy] { work(w, busy[w]); });
+        }
+        work(0, busy[0]);
+        for (auto& t : workers) {
+            t.join();
+        }
+
+        if (_error) {
+            std::rethrow_exception(std::exchange(_error, nullptr));
+        }
+
+        SchedulerStats stats;
+        const auto wall = std::chrono::steady_clock::now() - start;
+        stats.seconds = std::chrono::duration_cast<std::chrono::nanoseconds>(wall).count() * 1e-9;
+        uint64_t total_busy = 0;
+        for (const auto b : busy) {
+            total_busy += b;
+        }
+        const auto wall_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(wall).count();
+        stats.utilisation = wall_ns ? static_cast<double>(total_busy) / (static_cast<double>(wall_ns) * _threads) : 0;
+        for (const auto& t : _tasks) {
+            stats.instructions += t->instructions;
+        }
+        stats.instructions -= before;
+        stats.slices = _slices;
+        stats.steals = _steals;
+        return stats;
+    }
+
+    size_t size() const {
+        return _tasks.size();
+    }
+
+    Computer& get(Id id) {
+        return _tasks[id]->vm;
+    }
+
+    /// Outputs of a VM, when there is no output handler
+    InputOutputs& outputs(Id id) {
+        return _tasks[id]->outputs;
+    }
+
+    /// Instructions run by a VM, over every run()
+    uint64_t instructions(Id id) const {
+        return _tasks[id]->instructions;
+    }
+
+    bool halted(Id id) const {
+        return _tasks[id]->state == State::Halted;
+    }
+
+private:
+    enum class State {
+        Runnable = 0,
+        Parked,
+        Halted,
+    };
+
+    class Task {
+    public:
+        explicit Task(Computer c)
+            : vm(std::move(c))
+        {
+        }
+
+        Computer vm;
+        std::mutex lock;
+        InputOutputs inbox;
+        InputOutputs outputs;
+        State state = State::Runnable;
+        uint64_t instructions = 0;
+    };
+
+    /// One worker's runnable VMs, the owner takes the front, thieves the back
+    class Queue {
+    public:
+        void push(Id id) {
+            std::lock_guard<std::mutex> guard(_lock);
+            _ids.push_back(id);
+        }
+
+        bool pop(Id& id) {
+            std::lock_guard<std::mutex> guard(_lock);
+            if (_ids.empty()) {
+                return false;
+            }
+            id = _ids.front(); _ids.pop_front();
+            return true;
+        }
+
+        bool steal(Id& id) {
+            std::lock_guard<std::mutex> guard(_lock);
+            if (_ids.empty()) {
+                return false;
+            }
+            id = _ids.back(); _ids.pop_back();
+            return true;
+        }
+
+    private:
+        std::mutex _lock;
+        std::deque<Id> _ids;
+    };
+
+    size_t _threads;
+    uint64_t _quantum;
+    std::vector<Queue> _queues;
+    std::vector<std::unique_ptr<Task>> _tasks;
+    OutputHandler _handler;
+
+    /// VMs queued or being run, nothing else can make any more runnable
+    std::atomic<size_t> _runnable{ 0 };
+    std::atomic<uint64_t> _slices{ 0 };
+    std::atomic<uint64_t> _steals{ 0 };
+    std::atomic<bool> _failed{ false };
+    std::exception_ptr _error;
+    std::mutex _error_lock;
+
+    /// The scheduler whose worker is running on this thread, and that
+    /// worker's index, which only means anything to that scheduler
+    static inline thread_local const Scheduler* _scheduler = nullptr;
+    static inline thread_local size_t _worker = 0;
+
+    bool next(size_t w, Id& id) {
+        if (_queues[w].pop(id)) {
+            return true;
+        }
+        for (size_t i = 1; i < _threads; i++) {
+            if (_queues[(w + i) % _threads].steal(id)) {
+                _steals++;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void work(size_t w, uint64_t& busy) {
+        // An output handler may run another scheduler on this thread
+        const auto outer = std::make_pair(_scheduler, _worker);
+        _scheduler = this;
+        _worker = w;
+        while (_runnable && !_failed) {
+            Id id;
+            if (!next(w, id)) {
+                std::this_thread::yield();
+                continue;
+            }
+
+            const auto start = std::chrono::steady_clock::now();
+            try {
+                slice(w, id);
+            } catch (...) {
+                // The VM is neither queued nor parked, retire it so that a
+                // later run() doesn't wait for it forever
+                {
+                    auto& task = *_tasks[id];
+                    std::lock_guard<std::mutex> guard(task.lock);
+                    task.state = State::Halted;
+                    _runnable--;
+                }
+                std::lock_guard<std::mutex> guard(_error_lock);
+                if (!_error) {
+                    _error = std::current_exception();
+                }
+                _failed = true;
+            }
+            busy += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        }
+        std::tie(_scheduler, _worker) = outer;
+    }
+
+    /// Give one VM a quantum on worker w, then queue, park or retire it
+    void slice(size_t w, Id id) {
+        auto& task = *_tasks[id];
+        {
+            std::lock_guard<std::mutex> guard(task.lock);
+            while (!task.inbox.empty()) {
+                task.vm.set_input(task.inbox.front());
+                task.inbox.pop();
+            }
+        }
+
+        InputOutputs outputs;
+        uint64_t budget = _quantum;
+        const auto result = task.vm.run(outputs, budget);
+        task.instructions += _quantum - budget;
+        _slices++;
+
+        while (!outputs.empty()) {
+            if (_handler) {
+                _handler(id, outputs.front());
+            } else {
+                task.outputs.push(outputs.front());
+            }
+            outputs.pop();
+        }
+
+        std::lock_guard<std::mutex> guard(task.lock);
+        switch (result) {
+            case HaltCode::HasOutput:
+            case HaltCode::BudgetExhausted:
+                _queues[w].push(id);
+                return;
+            case HaltCode::NeedsInput:
+                if (!task.inbox.empty()) {
+                    _queues[w].push(id);
+                    return;
+                }
+                task.state = State::Parked;
+                break;
+            case HaltCode::Halt:
+            case HaltCode::Error:
+                task.state = State::Halted;
+                break;
+        }
+        _runnable--;
+    }
+};
+
+};
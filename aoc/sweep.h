@@ -0,0 +1,178 @@
+#pragma once
+
+#include "computer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace aoc19 {
+
+/*
+Runs one program over a parameter space on a pool of threads, for Day2's
+noun and verb search, Day7's phase permutations and the like.
+
+The space is the indices [0, count). Each worker owns one Computer, built
+once from the program and handed to the visitor for every index it takes,
+which initializes it, patches memory or queues inputs, and runs it (or
+forks it, to run several at once). Indices are handed out in small blocks
+from a shared counter. Small spaces, or a single thread, are run in a
+plain loop on the calling thread instead, where the threads would cost more
+than they save.
+
+find() stops every worker as soon as nothing below the lowest match so far
+is left, so the answer is always the lowest matching index, the same as a
+serial loop would find.
+*/
+class Sweep
+{
+public:
+    /// Indices a worker takes at a time
+    static constexpr size_t Block = 16;
+
+    /// Spaces with fewer indices than this are run serially
+    static constexpr size_t MinParallel = 64 * 1024;
+
+    explicit Sweep(const Program& program, size_t threads = std::thread::hardware_concurrency())
+        : _program(program)
+        , _threads(std::max<size_t>(threads, 1))
+    {
+    }
+
+    explicit Sweep(const std::string& program, size_t threads = std::thread::hardware_concurrency())
+        : Sweep(Program::load(program), threads)
+    {
+    }
+
+    /// Reset c to the start of the program, patch memory, queue the inputs
+    /// and run it to completion
+    static HaltCode run(Computer& c, const std::vector<std::pair<size_t, int64_t>>& patches,
+            const std::vector<int64_t>& inputs, InputOutputs& outputs) {
+        c.initialize();
+        for (const auto& p : patches) {
+            c.set_memory(p.first, p.second);
+        }
+        for (const auto i : inputs) {
+            c.set_input(i);
+        }
+        c.set_run_to_completion(true);
+        return c.run(outputs);
+    }
+
+    /// The lowest index for which test(index, computer) is true
+    template <typename Test>
+    std::optional<size_t> find(size_t count, Test test) const {
+        std::atomic<size_t> found{ SIZE_MAX };
+
+        parallel(count, found, [&](size_t index, Computer& c) {
+            if (test(index, c)) {
+                auto lowest = found.load();
+                while (index < lowest && !found.compare_exchange_weak(lowest, index)) {
+                }
+            }
+        });
+
+        const auto result = found.load();
+        if (result == SIZE_MAX) {
+            return std::nullopt;
+        }
+        return result;
+    }
+
+    /// combine(init, visit(index, computer)) over every index. combine must
+    /// not care about order, each worker folds its own indices before the
+    /// workers' results are folded together.
+    template <typename T, typename Visit, typename Combine>
+    T reduce(size_t count, T init, Visit visit, Combine combine) const {
+        std::atomic<size_t> unused{ SIZE_MAX };
+        std::mutex lock;
+        T result = init;
+
+        parallel_with_state(count, unused, [&] { return init; },
+            [&](T& local, size_t index, Computer& c) {
+                local = combine(std::move(local), visit(index, c));
+            },
+            [&](T& local) {
+                std::lock_guard<std::mutex> guard(lock);
+                result = combine(std::move(result), std::move(local));
+            });
+
+        return result;
+    }
+
+private:
+    Program _program;
+    size_t _threads;
+
+    template <typename Body>
+    void parallel(size_t count, std::atomic<size_t>& stop, Body body) const {
+        parallel_with_state(count, stop, [] { return 0; },
+            [&](int&, size_t index, Computer& c) { body(index, c); },
+            [](int&) {});
+    }
+
+    /// Run body(state, index, computer) for every index below stop, with
+    /// one state and one Computer per worker, then finish(state)
+    template <typename Start, typename Body, typename Finish>
+    void parallel_with_state(size_t count, std::atomic<size_t>& stop, Start start, Body body, Finish finish) const {
+        if (_threads <= 1 || count < MinParallel) {
+            auto state = start();
+            Computer c(_program);
+            for (size_t index = 0; index < count && index < stop.load(); index++) {
+                body(state, index, c);
+            }
+            finish(state);
+            return;
+        }
+
+        std::atomic<size_t> next{ 0 };
+        std::atomic<bool> failed{ false };
+        std::exception_ptr error;
+        std::mutex error_lock;
+
+        const auto work = [&] {
+            try {
+                auto state = start();
+                Computer c(_program);
+                while (!failed) {
+                    const auto first = next.fetch_add(Block);
+                    if (first >= count || first >= stop.load()) {
+                        break;
+                    }
+                    const auto last = std::min(first + Block, count);
+                    for (size_t index = first; index < last && index < stop.load(); index++) {
+                        body(state, index, c);
+                    }
+                }
+                finish(state);
+            } catch (...) {
+                std::lock_guard<std::mutex> guard(error_lock);
+                if (!error) {
+                    error = std::current_exception();
+                }
+                failed = true;
+            }
+        };
+
+        const auto workers = std::min(_threads, (count + Block - 1) / Block);
+        std::vector<std::thread> threads;
+        for (size_t t = 1; t < workers; t++) {
+            threads.emplace_back(work);
+        }
+        work();
+        for (auto& t : threads) {
+            t.join();
+        }
+
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+};
+
+};
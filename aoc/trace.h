@@ -0,0 +1,325 @@
+#pragma once
+
+#include "program.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace aoc19 {
+
+/*
+Execution traces of a Computer, enough to run it again without whatever
+drove it (see replay.h).
+
+A trace is everything the program saw from outside and did to the outside:
+every initialize() and set_memory() by the driver, every input it consumed
+and output it produced and, optionally, the target of every jump taken.
+Each record is a tag byte followed by varints, so most are two or three
+bytes, behind a 32 byte header:
+
+    0   8   "AOC19TR\0"
+    8   4   version
+    12  4   flags, 1 if taken branches are recorded
+    16  8   words in the program
+    24  8   hash of the program (Trace::hash())
+
+all little-endian.
+*/
+enum class TraceEvent : uint8_t {
+    Reset = 1,
+    Patch,
+    Input,
+    Output,
+    Branch,
+};
+
+class TraceRecord {
+public:
+    TraceEvent event;
+    /// Memory patched, for Patch
+    uint64_t address;
+    /// Value patched, input, output or jump target
+    int64_t value;
+
+    bool operator==(const TraceRecord& other) const {
+        return event == other.event && address == other.address && value == other.value;
+    }
+
+    bool operator!=(const TraceRecord& other) const {
+        return !(*this == other);
+    }
+
+    friend std::ostream& operator<<(std::ostream& os, const TraceRecord& r) {
+        static const char* const Names[] = { "?", "reset", "patch", "input", "output", "branch" };
+        os << Names[static_cast<size_t>(r.event) < 6 ? static_cast<size_t>(r.event) : 0];
+        if (r.event == TraceEvent::Patch) {
+            os << " [" << r.address << "]";
+        }
+        if (r.event != TraceEvent::Reset) {
+            os << " " << r.value;
+        }
+        return os;
+    }
+};
+
+/// A trace read back from a file or a recorder
+class Trace
+{
+public:
+    static constexpr char Magic[8] = { 'A', 'O', 'C', '1', '9', 'T', 'R', '\0' };
+    static constexpr uint32_t Version = 1;
+    static constexpr size_t HeaderSize = 32;
+    static constexpr uint32_t BranchesFlag = 1;
+
+    Trace(bool branches, uint64_t words, uint64_t program_hash, std::vector<TraceRecord> records)
+        : _branches(branches)
+        , _words(words)
+        , _hash(program_hash)
+        , _records(std::move(records))
+    {
+    }
+
+    static Trace load(const std::string& path) {
+        std::ifstream f(path, std::ios::binary);
+        const std::vector<uint8_t> bytes{ std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>() };
+        if (bytes.size() < HeaderSize || !std::equal(Magic, Magic + sizeof(Magic), bytes.begin())) {
+            throw std::runtime_error("Not an IntCode trace: " + path);
+        }
+        if (read_le(bytes.data() + 8, 4) != Version) {
+            throw std::runtime_error("Unsupported IntCode trace version: " + path);
+        }
+        return Trace(read_le(bytes.data() + 12, 4) & BranchesFlag, read_le(bytes.data() + 16, 8),
+            read_le(bytes.data() + 24, 8), decode(bytes.data() + HeaderSize, bytes.size() - HeaderSize, path));
+    }
+
+    /// FNV-1a over the program's words, to check a trace is replayed
+    /// against the program it was recorded from
+    static uint64_t hash(const Program& program) {
+        uint64_t h = 0xcbf29ce484222325ull;
+        for (const auto w : program) {
+            for (size_t i = 0; i < 8; i++) {
+                h = (h ^ ((static_cast<uint64_t>(w) >> (8 * i)) & 0xFF)) * 0x100000001b3ull;
+            }
+        }
+        return h;
+    }
+
+    bool matches(const Program& program) const {
+        return program.size() == _words && hash(program) == _hash;
+    }
+
+    bool branches() const {
+        return _branches;
+    }
+
+    const std::vector<TraceRecord>& records() const {
+        return _records;
+    }
+
+    static std::vector<TraceRecord> decode(const uint8_t* p, size_t length, const std::string& source) {
+        std::vector<TraceRecord> records;
+        const auto end = p + length;
+        while (p < end) {
+            TraceRecord r{ static_cast<TraceEvent>(*p++), 0, 0 };
+            switch (r.event) {
+                case TraceEvent::Reset:
+                    break;
+                case TraceEvent::Patch:
+                    r.address = read_varint(p, end, source);
+                    r.value = unzigzag(read_varint(p, end, source));
+                    break;
+                case TraceEvent::Input:
+                case TraceEvent::Output:
+                case TraceEvent::Branch:
+                    r.value = unzigzag(read_varint(p, end, source));
+                    break;
+                default:
+                    throw std::runtime_error("Corrupt IntCode trace: " + source);
+            }
+            records.push_back(r);
+        }
+        return records;
+    }
+
+    static uint64_t zigzag(int64_t v) {
+        return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63);
+    }
+
+    static int64_t unzigzag(uint64_t v) {
+        return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+    }
+
+private:
+    bool _branches;
+    uint64_t _words;
+    uint64_t _hash;
+    std::vector<TraceRecord> _records;
+
+    static uint64_t read_varint(const uint8_t*& p, const uint8_t* end, const std::string& source) {
+        uint64_t v = 0;
+        for (size_t shift = 0; shift < 64; shift += 7) {
+            if (p == end) {
+                break;
+            }
+            const auto byte = *p++;
+            v |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) {
+                return v;
+            }
+        }
+        throw std::runtime_error("Corrupt IntCode trace: " + source);
+    }
+};
+
+/*
+Records a trace for Computer::set_trace().
+
+Records are encoded into a fixed buffer which is written out to the file
+whenever it fills up, on flush() and when the recorder is destroyed, so
+recording costs a few stores per event. Without a file everything is kept
+in memory until drain().
+*/
+class TraceRecorder
+{
+public:
+    static constexpr size_t DefaultCapacity = 64 * 1024;
+
+    TraceRecorder(const std::string& path, const Program& program, bool branches = false, size_t capacity = DefaultCapacity)
+        : TraceRecorder(program, branches, capacity)
+    {
+        _file.open(path, std::ios::binary | std::ios::trunc);
+        if (!_file.good()) {
+            throw std::runtime_error("Unable to write " + path);
+        }
+        _file.write(Trace::Magic, sizeof(Trace::Magic));
+        write_le(_file, Trace::Version, 4);
+        write_le(_file, branches ? Trace::BranchesFlag : 0, 4);
+        write_le(_file, _words, 8);
+        write_le(_file, _hash, 8);
+    }
+
+    /// Keep the trace in memory
+    TraceRecorder(const Program& program, bool branches = false, size_t capacity = DefaultCapacity)
+        : _branches(branches)
+        , _words(program.size())
+        , _hash(Trace::hash(program))
+        , _buffer(std::max(capacity, MaxRecord * 2))
+        , _used(0)
+    {
+    }
+
+    /// A recorder writing to the file named by AOC_TRACE, with branches if
+    /// AOC_TRACE_BRANCHES=1, or none if AOC_TRACE isn't set
+    static std::shared_ptr<TraceRecorder> from_environment(const Program& program) {
+        const char* path = std::getenv("AOC_TRACE");
+        if (!path || !path[0]) {
+            return nullptr;
+        }
+        const char* branches = std::getenv("AOC_TRACE_BRANCHES");
+        return std::make_shared<TraceRecorder>(path, program, branches && branches[0] == '1');
+    }
+
+    TraceRecorder(const TraceRecorder&) = delete;
+    TraceRecorder& operator=(const TraceRecorder&) = delete;
+
+    ~TraceRecorder() {
+        flush();
+    }
+
+    bool branches() const {
+        return _branches;
+    }
+
+    void reset() {
+        put(TraceEvent::Reset);
+        commit();
+    }
+
+    void patch(size_t address, int64_t value) {
+        put(TraceEvent::Patch);
+        put_varint(address);
+        put_varint(Trace::zigzag(value));
+        commit();
+    }
+
+    void input(int64_t value) {
+        record(TraceEvent::Input, value);
+    }
+
+    void output(int64_t value) {
+        record(TraceEvent::Output, value);
+    }
+
+    void branch(size_t target) {
+        record(TraceEvent::Branch, static_cast<int64_t>(target));
+    }
+
+    /// Write out everything recorded so far
+    void flush() {
+        if (!_used) {
+            return;
+        }
+        if (_file.is_open()) {
+            _file.write(reinterpret_cast<const char*>(_buffer.data()), _used);
+            _file.flush();
+        } else {
+            _kept.insert(_kept.end(), _buffer.begin(), _buffer.begin() + _used);
+        }
+        _used = 0;
+    }
+
+    /// Everything recorded since the last drain(), for a recorder without
+    /// a file
+    std::vector<TraceRecord> drain() {
+        flush();
+        auto records = Trace::decode(_kept.data(), _kept.size(), "recorder");
+        _kept.clear();
+        return records;
+    }
+
+private:
+    /// Tag, plus two 10 byte varints
+    static constexpr size_t MaxRecord = 21;
+
+    bool _branches;
+    uint64_t _words;
+    uint64_t _hash;
+    std::ofstream _file;
+    std::vector<uint8_t> _buffer;
+    size_t _used;
+    std::vector<uint8_t> _kept;
+
+    void record(TraceEvent event, int64_t value) {
+        put(event);
+        put_varint(Trace::zigzag(value));
+        commit();
+    }
+
+    void put(TraceEvent event) {
+        _buffer[_used++] = static_cast<uint8_t>(event);
+    }
+
+    void put_varint(uint64_t v) {
+        while (v >= 0x80) {
+            _buffer[_used++] = static_cast<uint8_t>(v | 0x80);
+            v >>= 7;
+        }
+        _buffer[_used++] = static_cast<uint8_t>(v);
+    }
+
+    /// Make sure the next record fits
+    void commit() {
+        if (_buffer.size() - _used < MaxRecord) {
+            flush();
+        }
+    }
+};
+
+};
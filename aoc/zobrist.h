@@ -0,0 +1,84 @@
+#pragma once
+
+#include "memory.h"
+#include "program.h"
+
+#include <cstdint>
+
+namespace aoc19 {
+
+/*
+Zobrist style hash of a VM's state, so that searches which fork VMs can keep
+a set of the states they have seen without comparing whole memories.
+
+The memory hash is the XOR of a hash of every (address, value) pair with a
+nonzero value, so a store updates it in O(1) by taking out the old pair and
+putting in the new one, and memory that is dense or paged, or not written
+yet, hashes the same. The program counter and relative base are mixed in
+when the hash is asked for. Queued input is not part of it.
+
+Equal states always hash the same; different ones collide with probability
+around 2^-64 per pair.
+*/
+class ZobristHash
+{
+public:
+    bool enabled() const {
+        return _enabled;
+    }
+
+    void set_enabled(bool v) {
+        _enabled = v;
+    }
+
+    /// Hash memory from scratch
+    void reset(const Memory& dense, const PagedMemory& sparse) {
+        _memory = of(dense, sparse);
+    }
+
+    /// The word at address changed from old to value
+    void stored(size_t address, int64_t old, int64_t value) {
+        _memory ^= word(address, old) ^ word(address, value);
+    }
+
+    uint64_t memory() const {
+        return _memory;
+    }
+
+    uint64_t state(size_t pc, size_t relative_base) const {
+        return combine(_memory, pc, relative_base);
+    }
+
+    static uint64_t of(const Memory& dense, const PagedMemory& sparse) {
+        uint64_t h = 0;
+        for (size_t a = 0; a < dense.size(); a++) {
+            h ^= word(a, dense[a]);
+        }
+        sparse.for_each([&h](size_t address, int64_t value) { h ^= word(address, value); });
+        return h;
+    }
+
+    static uint64_t combine(uint64_t memory, size_t pc, size_t relative_base) {
+        return memory ^ mix(pc + 0x632be59bd9b4e019ull) ^ mix(mix(relative_base + 0x8cb92ba72f3d8dd7ull));
+    }
+
+    static uint64_t word(size_t address, int64_t value) {
+        if (!value) {
+            return 0;
+        }
+        return mix(address * 0x9e3779b97f4a7c15ull + mix(static_cast<uint64_t>(value)));
+    }
+
+private:
+    bool _enabled = false;
+    uint64_t _memory = 0;
+
+    /// splitmix64's finalizer
+    static uint64_t mix(uint64_t x) {
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+        return x ^ (x >> 31);
+    }
+};
+
+};